@@ -10,12 +10,25 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -26,6 +39,29 @@
 #define VERSION "0.1.0"
 #define TAB_STOP 8
 #define QUIT_CONFIRMATION 2
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_MAX_SIZE 4096
+#define SLAB_CLASSES 28
+#define UNDO_MAX_BYTES (16 * 1024 * 1024)
+#define JOURNAL_FLUSH_BYTES (64 * 1024)
+#define JOURNAL_FLUSH_MS 1000
+#define JOURNAL_MAX_DELAY_MS 5000
+#define BUFFER_CACHE_BUDGET (64 * 1024 * 1024)
+#define WATCH_CHUNK_SIZE (1024 * 1024)
+#define WORD_MAX_LEN 64
+#define COMPLETE_MAX 32
+#define BRACKET_BLOCK 32
+#define REPLACE_MAX_THREADS 8
+#define REPLACE_PARALLEL_ROWS 4096
+#define STREAM_CHUNK_SIZE (64 * 1024)
+#define STREAM_BATCH_BYTES (4 * 1024 * 1024)
+#define FILTER_CHUNK_SIZE (64 * 1024)
+#define FILTER_BATCH_BYTES (4 * 1024 * 1024)
+#define FILTER_IOV 512
+#define FILTER_KILL_MS 500
+#define PROF_SUMMARY_SIZE 80
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
 
 enum editorKey {
     BACKSPACE = 127,
@@ -38,6 +74,8 @@ enum editorKey {
     END,
     PAGE_UP,
     PAGE_DOWN,
+    PASTE_START,
+    PASTE_END,
 };
 
 enum editorHighlight {
@@ -48,12 +86,28 @@ enum editorHighlight {
     HL_KEYWORD2,
     HL_STRING,
     HL_NUMBER,
-    HL_MATCH
+    HL_MATCH,
+    HL_BRACKET
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define HL_SPAN(type, len) (((uint32_t)(len) << 8) | (type))
+#define HL_SPAN_TYPE(span) ((span) & 0xff)
+#define HL_SPAN_LEN(span) ((int)((span) >> 8))
+#define HL_SPAN_MAX 0xffffff
+
+#define ROW_RENDER_SHARED (1<<0)
+#define ROW_HL_STALE (1<<1)
+#define HL_STATE_UNKNOWN 2
+
+#define PROMPT_ALLOW_EMPTY (1<<0)
+
+#define PROF_ON() (E.prof.overlay || E.prof.trace)
+#define PROF_BEGIN() (PROF_ON() ? editorNowUs() : 0)
+#define PROF_END(phase, t0) do { if (t0) editorProfAdd(phase, t0); } while (0)
+
 /*** Data ***/
 
 struct editorSyntax {
@@ -70,31 +124,261 @@ typedef struct erow {
     int idx;
     int size;
     int rsize;
+    int hlcount;
     char *data;
     char *render;
-    unsigned char *hl;
-    int hl_open_comment;
+    uint32_t *hl;
+    unsigned char hl_open_comment;
+    unsigned char flags;
+    uint32_t stamp;
+    uint16_t brk_open[3];
+    uint16_t brk_close[3];
 } erow;
 
-struct editorConfig {
+enum overlaySlot {
+    OVERLAY_SEARCH = 0,
+    OVERLAY_BRACKET,
+    OVERLAY_BRACKET_MATCH,
+    OVERLAY_SLOTS
+};
+
+struct hlOverlay {
+    int row;
+    int start;
+    int len;
+    unsigned char hl;
+};
+
+enum undoOp {
+    UNDO_INSERT = 1,
+    UNDO_DELETE,
+    UNDO_INSERT_ROW,
+    UNDO_DELETE_ROW
+};
+
+struct undoRecord {
+    uint32_t group;
+    uint32_t op;
+    int32_t row;
+    int32_t col;
+    uint32_t len;
+};
+
+struct undoLog {
+    char *buf;
+    size_t head;
+    size_t top;
+    size_t cap;
+    size_t limit;
+    uint32_t group;
+    uint32_t skipgroup;
+    int sealed;
+    int suspended;
+};
+
+struct editorJournal {
+    int fd;
+    char *path;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t last;
+    long long pending_since;
+    int suspended;
+};
+
+struct slabPool {
+    void *freelist[SLAB_CLASSES];
+    struct slabChunk *chunks;
+    char *cur, *end;
+    struct slabLarge *large;
+    size_t allocs;
+    size_t frees;
+    size_t inuse;
+    size_t reserved;
+};
+
+struct wordNode {
+    uint32_t child;
+    uint32_t sibling;
+    uint32_t count;
+    uint32_t total;
+    unsigned char c;
+};
+
+struct wordIndex {
+    struct wordNode *nodes;
+    uint32_t numnodes;
+    uint32_t cap;
+};
+
+struct bracketSum {
+    uint32_t open[3];
+    uint32_t close[3];
+    uint32_t stale;
+};
+
+struct bracketTree {
+    struct bracketSum *node;
+    int leaves;
+    int valid;
+};
+
+struct rowText {
+    const char *s;
+    size_t len;
+};
+
+struct editorWatch {
+    int wd;
+    off_t size;
+    struct timespec mtime;
+};
+
+struct editorBuffer {
+    int numrows;
+    erow *row;
+    struct slabPool pool;
+    struct slabPool cache;
+    struct undoLog undo;
+    struct editorJournal journal;
+    struct wordIndex words;
+    struct bracketTree brackets;
+    int dirty;
+    char *filename;
+    struct editorSyntax *syntax;
+    int cx, cy;
+    int rowoffset;
+    int coloffset;
+    int cached;
+    long long lastused;
+    struct editorWatch watch;
+    int partial;
+    int follow;
+    int stream;
+    int maxrows;
+    int stale;
+    int hlnext;
+};
+
+struct viewLine {
+    int row;
+    int sub;
+    uint32_t stamp;
+};
+
+struct wrapRow {
+    uint32_t stamp;
+    int count;
+    int *breaks;
+};
+
+struct wrapCache {
+    struct editorBuffer *buf;
+    struct wrapRow *rows;
+    int numrows;
+    int width;
+    int *tree;
+    int valid;
+};
+
+struct editorView {
     int cx, cy;
     int rx;
     int rowoffset;
     int coloffset;
+    int sy, sx;
+    struct editorBuffer *buf;
+    struct hlOverlay overlay[OVERLAY_SLOTS];
+    int top, left;
+    int rows, cols;
+    struct viewLine *lines;
+    int drawn_coloffset;
+    int redraw;
+    int wrap;
+    int subrow;
+    struct wrapCache wraps;
+    struct editorLayout *node;
+};
+
+struct editorLayout {
+    struct editorLayout *parent;
+    struct editorLayout *child[2];
+    struct editorView *view;
+    int vertical;
+    int top, left;
+    int rows, cols;
+};
+
+enum profPhase {
+    PROF_KEYPRESS = 0,
+    PROF_SYNTAX,
+    PROF_DRAW,
+    PROF_WRITE,
+    PROF_PHASES
+};
+
+struct editorProfile {
+    int overlay;
+    int inkey;
+    FILE *trace;
+    long long frame_start;
+    long long idle;
+    long long start[PROF_PHASES];
+    long long time[PROF_PHASES];
+    long long rows, allocs;
+    char summary[PROF_SUMMARY_SIZE];
+};
+
+struct editorCompletion {
+    int row, col;
+    int prefixlen;
+    int inserted;
+    int count, next;
+    char words[COMPLETE_MAX][WORD_MAX_LEN + 1];
+};
+
+struct editorConfig {
     int screenrows;
     int screencols;
-    int numrows;
-    erow *row;
-    int dirty;
-    char *filename;
+    struct editorBuffer **buffers;
+    int numbuffers;
+    struct editorBuffer *buf;
+    struct editorView **views;
+    int numviews;
+    struct editorView *view;
+    struct editorLayout *layout;
+    int redraw;
+    uint32_t stamp;
+    int pasting;
+    int inotify;
+    size_t undolimit;
+    struct editorCompletion complete;
+    struct editorProfile prof;
     char statusmsg[80];
     time_t statusmsg_time;
-    struct editorSyntax *syntax;
     struct termios orig_termios;
 };
 
 struct editorConfig E;
 
+#ifdef TE_BENCH
+struct benchState {
+    const char *scenario;
+    const char *filename;
+    char *saveas;
+    int rows, cols;
+    int ptmx, pts;
+    long long start, open_us;
+    long long key_at;
+    long long keys, bytes;
+    long long *frames;
+    size_t numframes, capframes;
+};
+
+struct benchState bench;
+#endif
+
 /*** Filetypes ***/
 
 char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", NULL};
@@ -119,11 +403,227 @@ struct editorSyntax HLDB[] = {
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
 
+/*** Row Storage ***/
+
+struct slabChunk {
+    struct slabChunk *next;
+    void *pad;
+};
+
+struct slabLarge {
+    struct slabLarge *prev;
+    struct slabLarge *next;
+};
+
+int slabClass(size_t n) {
+    if (n <= 128) return n ? (n - 1) >> 4 : 0;
+    int lg = 63 - __builtin_clzl(n - 1);
+    return 8 + (lg - 7) * 4 + (((n - 1) >> (lg - 2)) & 3);
+}
+
+size_t slabClassSize(int class) {
+    if (class < 8) return (class + 1) * 16;
+    size_t base = (size_t)128 << ((class - 8) / 4);
+    return base + ((class - 8) % 4 + 1) * (base / 4);
+}
+
+void *slabAlloc(struct slabPool *pool, size_t n) {
+    pool->allocs++;
+    E.prof.allocs++;
+
+    if (n > SLAB_MAX_SIZE) {
+        struct slabLarge *l = malloc(sizeof(struct slabLarge) + n);
+        if (l == NULL) return NULL;
+        l->prev = NULL;
+        l->next = pool->large;
+        if (pool->large) pool->large->prev = l;
+        pool->large = l;
+        pool->inuse += n;
+        pool->reserved += n;
+        return l + 1;
+    }
+
+    int class = slabClass(n);
+    size_t size = slabClassSize(class);
+    pool->inuse += size;
+
+    void *p = pool->freelist[class];
+    if (p) {
+        pool->freelist[class] = *(void **)p;
+        return p;
+    }
+
+    if (pool->cur == NULL || (size_t)(pool->end - pool->cur) < size) {
+        struct slabChunk *chunk = malloc(SLAB_CHUNK_SIZE);
+        if (chunk == NULL) return NULL;
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
+        pool->cur = (char *)(chunk + 1);
+        pool->end = (char *)chunk + SLAB_CHUNK_SIZE;
+        pool->reserved += SLAB_CHUNK_SIZE;
+    }
+    p = pool->cur;
+    pool->cur += size;
+    return p;
+}
+
+void slabFree(struct slabPool *pool, void *p, size_t n) {
+    if (p == NULL) return;
+    pool->frees++;
+
+    if (n > SLAB_MAX_SIZE) {
+        struct slabLarge *l = (struct slabLarge *)p - 1;
+        if (l->prev) l->prev->next = l->next;
+        else pool->large = l->next;
+        if (l->next) l->next->prev = l->prev;
+        pool->inuse -= n;
+        pool->reserved -= n;
+        free(l);
+        return;
+    }
+
+    int class = slabClass(n);
+    pool->inuse -= slabClassSize(class);
+    *(void **)p = pool->freelist[class];
+    pool->freelist[class] = p;
+}
+
+void *slabRealloc(struct slabPool *pool, void *p, size_t oldn, size_t n) {
+    if (p == NULL) return slabAlloc(pool, n);
+
+    if (oldn <= SLAB_MAX_SIZE && n <= SLAB_MAX_SIZE &&
+        slabClass(oldn) == slabClass(n))
+        return p;
+
+    if (oldn > SLAB_MAX_SIZE && n > SLAB_MAX_SIZE) {
+        struct slabLarge *l = (struct slabLarge *)p - 1;
+        struct slabLarge *new = realloc(l, sizeof(struct slabLarge) + n);
+        if (new == NULL) return NULL;
+        if (new->prev) new->prev->next = new;
+        else pool->large = new;
+        if (new->next) new->next->prev = new;
+        pool->inuse += n - oldn;
+        pool->reserved += n - oldn;
+        return new + 1;
+    }
+
+    void *new = slabAlloc(pool, n);
+    if (new == NULL) return NULL;
+    memcpy(new, p, oldn < n ? oldn : n);
+    slabFree(pool, p, oldn);
+    return new;
+}
+
+void slabRelease(struct slabPool *pool) {
+    while (pool->chunks) {
+        struct slabChunk *next = pool->chunks->next;
+        free(pool->chunks);
+        pool->chunks = next;
+    }
+    while (pool->large) {
+        struct slabLarge *next = pool->large->next;
+        free(pool->large);
+        pool->large = next;
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+/*** Profiling ***/
+
+char *profPhaseNames[PROF_PHASES] = {
+    "editorProcessKeypress", "editorUpdateSyntax", "editorDrawView", "write"
+};
+
+long long editorNowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void editorProfAdd(int phase, long long t0) {
+    if (E.prof.start[phase] == 0) E.prof.start[phase] = t0;
+    E.prof.time[phase] += editorNowUs() - t0;
+}
+
+void editorProfClose() {
+    fprintf(E.prof.trace, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"TE\"}}\n]\n", (int)getpid());
+    fclose(E.prof.trace);
+    E.prof.trace = NULL;
+}
+
+void editorProfOpen(const char *path) {
+    E.prof.trace = fopen(path, "w");
+    if (E.prof.trace == NULL) return;
+    fputs("[\n", E.prof.trace);
+    atexit(editorProfClose);
+}
+
+void editorProfFrame(size_t bytes) {
+    struct editorProfile *p = &E.prof;
+    if (!PROF_ON()) {
+        p->rows = p->allocs = 0;
+        return;
+    }
+
+    long long end = editorNowUs();
+    if (p->frame_start == 0) {
+        p->frame_start = end;
+        for (int i = 0; i < PROF_PHASES; i++)
+            if (p->start[i] && p->start[i] < p->frame_start) p->frame_start = p->start[i];
+    }
+    p->time[PROF_KEYPRESS] -= p->idle;
+    if (p->time[PROF_KEYPRESS] < 0) p->time[PROF_KEYPRESS] = 0;
+
+    snprintf(p->summary, sizeof(p->summary),
+             "key %lldus hl %lldus/%lld draw %lldus wr %lldus %zuB %lld allocs",
+             p->time[PROF_KEYPRESS], p->time[PROF_SYNTAX], p->rows,
+             p->time[PROF_DRAW], p->time[PROF_WRITE], bytes, p->allocs);
+
+    if (p->trace) {
+        int pid = getpid();
+        fprintf(p->trace, "{\"name\":\"frame\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,"
+                "\"ts\":%lld,\"dur\":%lld},\n", pid, p->frame_start, end - p->frame_start);
+        /* Phases run many times and nest inside each other, so their
+         * per-frame totals go out as counters rather than slices. */
+        fprintf(p->trace, "{\"name\":\"phase us\",\"ph\":\"C\",\"pid\":%d,"
+                "\"ts\":%lld,\"args\":{", pid, p->frame_start);
+        for (int i = 0; i < PROF_PHASES; i++)
+            fprintf(p->trace, "%s\"%s\":%lld", i ? "," : "", profPhaseNames[i], p->time[i]);
+        fputs("}},\n", p->trace);
+        fprintf(p->trace, "{\"name\":\"frame stats\",\"ph\":\"C\",\"pid\":%d,"
+                "\"ts\":%lld,\"args\":{\"rows highlighted\":%lld,"
+                "\"bytes written\":%zu,\"allocations\":%lld}},\n",
+                pid, p->frame_start, p->rows, bytes, p->allocs);
+    }
+
+    p->frame_start = p->idle = p->rows = p->allocs = 0;
+    memset(p->start, 0, sizeof(p->start));
+    memset(p->time, 0, sizeof(p->time));
+}
+
 /*** Prototypes ***/
 
 void editorSetStatusMessage(const char* fmt, ...);
+void editorSetOverlay(int slot, int row, int start, int len, unsigned char hl);
+void editorViewInvalidateRow(struct editorView *view, int row);
+int editorBufferShown(struct editorBuffer *buf);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorUndoRecord(int op, int row, int col, const char *s, int len);
+void editorJournalRecord(int op, int row, int col, const char *s, int len);
+void editorIdle();
+void editorRowBrackets(erow *row);
+void editorWrapRowChanged(erow *row);
+void editorWrapShift(int at, int del, int count);
+void editorWrapReset(struct editorView *view);
+void editorHighlightRow(struct editorBuffer *buf, int r);
+int editorBufferIndex(struct editorBuffer *buf);
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int flags);
+#ifdef TE_BENCH
+void benchKeyRead();
+void benchFinish();
+void benchOutput(const char *s, size_t len);
+#endif
 
 /*** Terminal ***/
 
@@ -136,6 +636,7 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -154,14 +655,24 @@ void enableRawMode() {
     raw.c_cc[VTIME] = 1;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 int editorReadKey() {
     int nread;
     char c;
+    long long idle = E.prof.inkey ? editorNowUs() : 0;
     while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
         if (nread == -1 && errno != EAGAIN) die("read");
+#ifdef TE_BENCH
+        if (nread == 0) benchFinish();
+#endif
+        editorIdle();
     }
+#ifdef TE_BENCH
+    benchKeyRead();
+#endif
+    if (idle) E.prof.idle += editorNowUs() - idle;
 
     if (c == '\x1b') {
         char seq[3];
@@ -172,6 +683,17 @@ int editorReadKey() {
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
                 if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                if (seq[2] >= '0' && seq[2] <= '9') {
+                    /* Two-digit keys (F5-F12, ESC[20~ for F9) end here; only
+                     * ESC[200~ and ESC[201~ carry a third digit. */
+                    char next, tilde;
+                    if (read(STDIN_FILENO, &next, 1) != 1) return '\x1b';
+                    if (next == '~' || seq[1] != '2' || seq[2] != '0' ||
+                        (next != '0' && next != '1'))
+                        return '\x1b';
+                    if (read(STDIN_FILENO, &tilde, 1) != 1 || tilde != '~') return '\x1b';
+                    return next == '0' ? PASTE_START : PASTE_END;
+                }
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1': return HOME;
@@ -227,6 +749,12 @@ int getCursorPosition(int *rows, int *cols) {
 int getWindowSize(int *rows, int *cols) {
     struct winsize ws;
 
+#ifdef TE_BENCH
+    *rows = bench.rows;
+    *cols = bench.cols;
+    return 0;
+#endif
+
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 ||
         ws.ws_col == 0) {
         if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
@@ -243,17 +771,68 @@ int is_separator(int c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+struct hlBuilder {
+    uint32_t *spans;
+    int count;
+    int cap;
+};
+
+void hlPush(struct hlBuilder *b, unsigned char type, int len) {
+    if (b->count > 0 && HL_SPAN_TYPE(b->spans[b->count - 1]) == type) {
+        int last = HL_SPAN_LEN(b->spans[b->count - 1]);
+        int take = HL_SPAN_MAX - last;
+        if (take > len) take = len;
+        b->spans[b->count - 1] = HL_SPAN(type, last + take);
+        len -= take;
+    }
+    while (len > 0) {
+        if (b->count == b->cap) {
+            b->cap = b->cap ? b->cap * 2 : 64;
+            b->spans = realloc(b->spans, sizeof(uint32_t) * b->cap);
+        }
+        int take = len > HL_SPAN_MAX ? HL_SPAN_MAX : len;
+        b->spans[b->count++] = HL_SPAN(type, take);
+        len -= take;
+    }
+}
+
+unsigned char hlLast(struct hlBuilder *b) {
+    return b->count ? HL_SPAN_TYPE(b->spans[b->count - 1]) : HL_NORMAL;
+}
 
-    if (E.syntax == NULL) return;
+void editorUpdateSyntax(erow *row) {
+    static struct hlBuilder b;
+    /* Rows loaded from the cache may follow rows whose comment state is
+     * not known yet; catch up from the nearest known state above. */
+    if (row->idx > 0 && E.buf->row[row->idx - 1].hl_open_comment == HL_STATE_UNKNOWN) {
+        int s = row->idx - 1;
+        while (s > 0 && E.buf->row[s - 1].hl_open_comment == HL_STATE_UNKNOWN) s--;
+        editorUpdateSyntax(&E.buf->row[s]);
+    }
+    if (row->flags & ROW_HL_STALE) {
+        row->flags &= ~ROW_HL_STALE;
+        E.buf->stale--;
+    }
+    long long prof = PROF_BEGIN();
+    b.count = 0;
+    row->stamp = ++E.stamp;
+    E.prof.rows++;
+
+    slabFree(&E.buf->cache, row->hl, sizeof(uint32_t) * row->hlcount);
+    row->hl = NULL;
+    row->hlcount = 0;
+
+    if (E.buf->syntax == NULL) {
+        editorRowBrackets(row);
+        editorWrapRowChanged(row);
+        return;
+    }
 
-    char **keywords = E.syntax->keywords;
+    char **keywords = E.buf->syntax->keywords;
 
-    char *scs = E.syntax->singleline_comment;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+    char *scs = E.buf->syntax->singleline_comment;
+    char *mcs = E.buf->syntax->multiline_comment_start;
+    char *mce = E.buf->syntax->multiline_comment_end;
 
     int scs_len = scs ? strlen(scs) : 0;
     int mcs_len = mcs ? strlen(mcs) : 0;
@@ -261,49 +840,49 @@ void editorUpdateSyntax(erow *row) {
 
     int prev_sep = 1;
     int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    int in_comment = (row->idx > 0 && E.buf->row[row->idx - 1].hl_open_comment);
 
     int i = 0;
     while (i < row->rsize) {
         char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        unsigned char prev_hl = hlLast(&b);
 
         if (scs_len && !in_string && !in_comment) {
             if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+                hlPush(&b, HL_COMMENT, row->rsize - i);
                 break;
             }
         }
 
         if (mcs_len && mce_len && !in_string) {
             if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
                 if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                    hlPush(&b, HL_MLCOMMENT, mce_len);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
                     continue;
                 } else {
+                    hlPush(&b, HL_MLCOMMENT, 1);
                     i++;
                     continue;
                 }
             } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+                hlPush(&b, HL_MLCOMMENT, mcs_len);
                 i += mcs_len;
                 in_comment = 1;
                 continue;
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+        if (E.buf->syntax->flags & HL_HIGHLIGHT_STRINGS) {
             if (in_string) {
-                row->hl[i] = HL_STRING;
                 if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
+                    hlPush(&b, HL_STRING, 2);
                     i += 2;
                     continue;
                 }
+                hlPush(&b, HL_STRING, 1);
                 if (c == in_string) in_string = 0;
                 i++;
                 prev_sep = 0;
@@ -311,17 +890,17 @@ void editorUpdateSyntax(erow *row) {
             } else {
                 if (c == '"' || c == '\'') {
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    hlPush(&b, HL_STRING, 1);
                     i++;
                     continue;
                 }
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+        if (E.buf->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
             if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
                 (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
+                hlPush(&b, HL_NUMBER, 1);
                 i++;
                 prev_sep = 0;
                 continue;
@@ -336,7 +915,7 @@ void editorUpdateSyntax(erow *row) {
 
                 if (!strncmp(&row->render[i], keywords[j], klen) &&
                     is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 :HL_KEYWORD1, klen);
+                    hlPush(&b, kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
                     i += klen;
                     break;
                 }
@@ -347,13 +926,25 @@ void editorUpdateSyntax(erow *row) {
             }
         }
 
+        hlPush(&b, HL_NORMAL, 1);
         prev_sep = is_separator(c);
         i++;
     }
+
+    if (b.count && HL_SPAN_TYPE(b.spans[b.count - 1]) == HL_NORMAL) b.count--;
+    if (b.count) {
+        row->hl = slabAlloc(&E.buf->cache, sizeof(uint32_t) * b.count);
+        memcpy(row->hl, b.spans, sizeof(uint32_t) * b.count);
+        row->hlcount = b.count;
+    }
+
     int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    editorRowBrackets(row);
+    editorWrapRowChanged(row);
+    PROF_END(PROF_SYNTAX, prof);
+    if (changed && row->idx + 1 < E.buf->numrows)
+        editorUpdateSyntax(&E.buf->row[row->idx + 1]);
 }
 
 
@@ -367,15 +958,16 @@ int editorSyntaxToColor(int hl) {
         case HL_STRING: return 32;
         case HL_NUMBER: return 36;
         case HL_MATCH: return 31;
+        case HL_BRACKET: return 94;
         default: return 37;
     }
 }
 
 void editorSelectSyntaxHighlight() {
-    E.syntax = NULL;
-    if (E.filename == NULL) return;
+    E.buf->syntax = NULL;
+    if (E.buf->filename == NULL) return;
 
-    char *extension = strrchr(E.filename, '.');
+    char *extension = strrchr(E.buf->filename, '.');
 
     for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
         struct editorSyntax *s = &HLDB[j];
@@ -383,12 +975,12 @@ void editorSelectSyntaxHighlight() {
         while (s->filematch[i]) {
             int is_extension = (s->filematch[i][0] == '.');
             if ((is_extension && extension && !strcmp(extension, s->filematch[i])) ||
-                (!is_extension && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
+                (!is_extension && strstr(E.buf->filename, s->filematch[i]))) {
+                E.buf->syntax = s;
 
                 int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
+                for (filerow = 0; filerow < E.buf->numrows; filerow++) {
+                    editorUpdateSyntax(&E.buf->row[filerow]);
                 }
                 return;
                 }
@@ -397,6 +989,99 @@ void editorSelectSyntaxHighlight() {
     }
 }
 
+/*** Word Index ***/
+
+int is_word_char(int c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+void wordIndexAdjust(struct wordIndex *ix, const char *w, int len, int delta) {
+    if (ix->nodes == NULL) {
+        ix->cap = 1024;
+        ix->nodes = calloc(ix->cap, sizeof(struct wordNode));
+        ix->numnodes = 1;
+    }
+
+    uint32_t node = 0;
+    ix->nodes[0].total += delta;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = w[i];
+        uint32_t prev = 0, cur = ix->nodes[node].child;
+        while (cur && ix->nodes[cur].c < c) {
+            prev = cur;
+            cur = ix->nodes[cur].sibling;
+        }
+        if (cur == 0 || ix->nodes[cur].c != c) {
+            if (delta < 0) return;
+            if (ix->numnodes == ix->cap) {
+                ix->cap *= 2;
+                ix->nodes = realloc(ix->nodes, sizeof(struct wordNode) * ix->cap);
+            }
+            uint32_t n = ix->numnodes++;
+            memset(&ix->nodes[n], 0, sizeof(struct wordNode));
+            ix->nodes[n].c = c;
+            ix->nodes[n].sibling = cur;
+            if (prev) ix->nodes[prev].sibling = n;
+            else ix->nodes[node].child = n;
+            cur = n;
+        }
+        node = cur;
+        ix->nodes[node].total += delta;
+    }
+    ix->nodes[node].count += delta;
+}
+
+/* Add (delta 1) or remove (delta -1) every identifier in data[from, to).
+ * Callers pass ranges that start and end on word boundaries. */
+void editorIndexWords(const char *data, int from, int to, int delta) {
+    int i = from;
+    while (i < to) {
+        if (!is_word_char(data[i])) {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < to && is_word_char(data[i])) i++;
+        if (i - start >= 2 && i - start <= WORD_MAX_LEN && !isdigit(data[start]))
+            wordIndexAdjust(&E.buf->words, &data[start], i - start, delta);
+    }
+}
+
+void wordIndexCollect(struct wordIndex *ix, uint32_t node, char *word, int len,
+                      struct editorCompletion *out) {
+    for (uint32_t n = ix->nodes[node].child; n && out->count < COMPLETE_MAX;
+         n = ix->nodes[n].sibling) {
+        if (ix->nodes[n].total == 0 || len >= WORD_MAX_LEN) continue;
+        word[len] = ix->nodes[n].c;
+        if (ix->nodes[n].count > 0) {
+            memcpy(out->words[out->count], word, len + 1);
+            out->words[out->count][len + 1] = '\0';
+            out->count++;
+        }
+        wordIndexCollect(ix, n, word, len + 1, out);
+    }
+}
+
+int wordIndexComplete(struct wordIndex *ix, const char *prefix, int len,
+                      struct editorCompletion *out) {
+    out->count = 0;
+    if (ix->nodes == NULL) return 0;
+
+    uint32_t node = 0;
+    for (int i = 0; i < len && node != UINT32_MAX; i++) {
+        uint32_t cur = ix->nodes[node].child;
+        while (cur && ix->nodes[cur].c != (unsigned char)prefix[i])
+            cur = ix->nodes[cur].sibling;
+        node = cur ? cur : UINT32_MAX;
+    }
+    if (node == UINT32_MAX) return 0;
+
+    char word[WORD_MAX_LEN + 1];
+    memcpy(word, prefix, len);
+    wordIndexCollect(ix, node, word, len, out);
+    return out->count;
+}
+
 /*** Row Operations ***/
 
 int editorRowCxToRx(erow *row, int cx) {
@@ -422,14 +1107,31 @@ int editorRowRxToCx(erow *row, int rx) {
     return cx;
 }
 
-void editorUpdateRow(erow *row) {
+void editorClampCursor(struct editorBuffer *buf, int *cy, int *cx) {
+    if (*cy > buf->numrows) *cy = buf->numrows;
+    if (*cy < 0) *cy = 0;
+    int rowlen = *cy < buf->numrows ? buf->row[*cy].size : 0;
+    if (*cx > rowlen) *cx = rowlen;
+}
+
+void editorUpdateRender(erow *row) {
     int tabs = 0;
     int j;
     for (j = 0; j < row->size; j++)
         if (row->data[j] == '\t') tabs++;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+    if (!(row->flags & ROW_RENDER_SHARED))
+        slabFree(&E.buf->cache, row->render, row->rsize + 1);
+
+    if (tabs == 0) {
+        row->render = row->data;
+        row->rsize = row->size;
+        row->flags |= ROW_RENDER_SHARED;
+        return;
+    }
+
+    row->render = slabAlloc(&E.buf->cache, row->size + tabs*(TAB_STOP - 1) + 1);
+    row->flags &= ~ROW_RENDER_SHARED;
 
     int idx = 0;
     for (j = 0; j < row->size; j++) {
@@ -442,264 +1144,2751 @@ void editorUpdateRow(erow *row) {
     }
     row->render[idx] = '\0';
     row->rsize = idx;
+}
 
+void editorUpdateRow(erow *row) {
+    editorUpdateRender(row);
     editorUpdateSyntax(row);
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
-
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j < E.numrows; j++) E.row[j].idx++;
-
-    E.row[at].idx = at;
+void editorInitRow(erow *row, int at, const char *s, size_t len) {
+    row->idx = at;
+
+    row->size = len;
+    row->data = slabAlloc(&E.buf->pool, len + 1);
+    memcpy(row->data, s, len);
+    row->data[len] = '\0';
+    editorIndexWords(row->data, 0, len, 1);
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hlcount = 0;
+    row->hl_open_comment = 0;
+    row->flags = 0;
+    memset(row->brk_open, 0, sizeof(row->brk_open));
+    memset(row->brk_close, 0, sizeof(row->brk_close));
+}
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.buf->numrows) return;
+    editorUndoRecord(UNDO_INSERT_ROW, at, 0, s, len);
+    editorJournalRecord(UNDO_INSERT_ROW, at, 0, s, len);
+    E.buf->brackets.valid = 0;
 
-    E.row[at].size = len;
-    E.row[at].data = malloc(len + 1);
-    memcpy(E.row[at].data, s, len);
-    E.row[at].data[len] = '\0';
+    E.buf->row = realloc(E.buf->row, sizeof(erow) * (E.buf->numrows + 1));
+    memmove(&E.buf->row[at + 1], &E.buf->row[at], sizeof(erow) * (E.buf->numrows - at));
+    for (int j = at + 1; j <= E.buf->numrows; j++) E.buf->row[j].idx++;
+    editorWrapShift(at, 0, 1);
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    editorInitRow(&E.buf->row[at], at, s, len);
+    editorUpdateRow(&E.buf->row[at]);
 
-    E.numrows++;
-    E.dirty++;
+    E.buf->numrows++;
+    E.buf->dirty++;
 }
 
 void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->data);
-    free(row->hl);
+    if (row->flags & ROW_HL_STALE) E.buf->stale--;
+    editorIndexWords(row->data, 0, row->size, -1);
+    if (!(row->flags & ROW_RENDER_SHARED))
+        slabFree(&E.buf->cache, row->render, row->rsize + 1);
+    slabFree(&E.buf->pool, row->data, row->size + 1);
+    slabFree(&E.buf->cache, row->hl, sizeof(uint32_t) * row->hlcount);
+}
+
+void editorFreeRows() {
+    slabRelease(&E.buf->pool);
+    slabRelease(&E.buf->cache);
+    free(E.buf->row);
+    E.buf->row = NULL;
+    E.buf->numrows = 0;
+    E.buf->stale = 0;
+    E.buf->hlnext = 0;
+    free(E.buf->words.nodes);
+    memset(&E.buf->words, 0, sizeof(E.buf->words));
+    free(E.buf->brackets.node);
+    memset(&E.buf->brackets, 0, sizeof(E.buf->brackets));
 }
 
 void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+    if (at < 0 || at >= E.buf->numrows) return;
+    editorUndoRecord(UNDO_DELETE_ROW, at, 0, E.buf->row[at].data, E.buf->row[at].size);
+    editorJournalRecord(UNDO_DELETE_ROW, at, 0, E.buf->row[at].data, E.buf->row[at].size);
+    E.buf->brackets.valid = 0;
+    editorFreeRow(&E.buf->row[at]);
+    memmove(&E.buf->row[at], &E.buf->row[at + 1], sizeof(erow) * (E.buf->numrows - at - 1));
+    for (int j = at; j < E.buf->numrows - 1; j++) E.buf->row[j].idx--;
+    editorWrapShift(at, 1, 0);
+    E.buf->numrows--;
+    E.buf->dirty++;
 }
 
-void editorRowInsertChar(erow *row, int at, char c) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->data = realloc(row->data, row->size + 2);
-    memmove(&row->data[at + 1], &row->data[at], row->size - at + 1);
-    row->size++;
-    row->data[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+/* Replace del rows starting at `at` with count new rows, moving the tail
+ * of the row array once instead of once per row. */
+void editorSpliceRows(int at, int del, const struct rowText *text, int count) {
+    if (at < 0 || at > E.buf->numrows) return;
+    if (del > E.buf->numrows - at) del = E.buf->numrows - at;
+    E.buf->brackets.valid = 0;
+
+    for (int j = 0; j < del; j++) {
+        erow *row = &E.buf->row[at + j];
+        editorUndoRecord(UNDO_DELETE_ROW, at, 0, row->data, row->size);
+        editorJournalRecord(UNDO_DELETE_ROW, at, 0, row->data, row->size);
+        editorFreeRow(row);
+    }
+
+    int numrows = E.buf->numrows - del + count;
+    int tail = E.buf->numrows - at - del;
+    if (count > del) E.buf->row = realloc(E.buf->row, sizeof(erow) * numrows);
+    memmove(&E.buf->row[at + count], &E.buf->row[at + del], sizeof(erow) * tail);
+    for (int j = at + count; j < numrows; j++) E.buf->row[j].idx = j;
+    editorWrapShift(at, del, count);
+
+    for (int j = 0; j < count; j++) {
+        editorUndoRecord(UNDO_INSERT_ROW, at + j, 0, text[j].s, text[j].len);
+        editorJournalRecord(UNDO_INSERT_ROW, at + j, 0, text[j].s, text[j].len);
+        editorInitRow(&E.buf->row[at + j], at + j, text[j].s, text[j].len);
+    }
+    E.buf->numrows = numrows;
+
+    for (int j = 0; j < count; j++) editorUpdateRow(&E.buf->row[at + j]);
+    if (del && at + count < numrows) editorUpdateSyntax(&E.buf->row[at + count]);
+    E.buf->dirty++;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->data = realloc(row->data, row->size + len + 1);
-    memcpy(&row->data[row->size], s, len);
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+    if (at < 0 || at > row->size) at = row->size;
+    editorUndoRecord(UNDO_INSERT, row->idx, at, s, len);
+    editorJournalRecord(UNDO_INSERT, row->idx, at, s, len);
+
+    int start = at, end = at;
+    while (start > 0 && is_word_char(row->data[start - 1])) start--;
+    while (end < row->size && is_word_char(row->data[end])) end++;
+    editorIndexWords(row->data, start, end, -1);
+
+    row->data = slabRealloc(&E.buf->pool, row->data, row->size + 1, row->size + len + 1);
+    memmove(&row->data[at + len], &row->data[at], row->size - at + 1);
+    memcpy(&row->data[at], s, len);
     row->size += len;
-    row->data[row->size] = '\0';
+    editorIndexWords(row->data, start, end + len, 1);
     editorUpdateRow(row);
-    E.dirty++;
+    E.buf->dirty++;
 }
 
-void editorRowDelChar(erow *row, int at) {
+void editorRowDelString(erow *row, int at, size_t len) {
     if (at < 0 || at >= row->size) return;
-    memmove(&row->data[at], &row->data[at + 1], row->size - at);
-    row->size--;
+    if (len > (size_t)(row->size - at)) len = row->size - at;
+    editorUndoRecord(UNDO_DELETE, row->idx, at, &row->data[at], len);
+    editorJournalRecord(UNDO_DELETE, row->idx, at, &row->data[at], len);
+
+    int start = at, end = at + len;
+    while (start > 0 && is_word_char(row->data[start - 1])) start--;
+    while (end < row->size && is_word_char(row->data[end])) end++;
+    editorIndexWords(row->data, start, end, -1);
+
+    memmove(&row->data[at], &row->data[at + len], row->size - at - len + 1);
+    row->size -= len;
+    editorIndexWords(row->data, start, end - len, 1);
+    row->data = slabRealloc(&E.buf->pool, row->data, row->size + len + 1, row->size + 1);
     editorUpdateRow(row);
-    E.dirty++;
+    E.buf->dirty++;
 }
 
-/** Editor Operations ***/
+void editorRowInsertChar(erow *row, int at, char c) {
+    editorRowInsertString(row, at, &c, 1);
+}
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
-    }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowInsertString(row, row->size, s, len);
 }
 
-void editorInsertNewline() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
-    } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->data[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->data[row->size] = '\0';
-        editorUpdateRow(row);
-    }
-    E.cy++;
-    E.cx = 0;
+void editorRowDelChar(erow *row, int at) {
+    editorRowDelString(row, at, 1);
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+void editorRowTruncate(erow *row, int at) {
+    editorRowDelString(row, at, row->size - at);
+}
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->data, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+/*** Brackets ***/
+
+int bracketType(int c, int *open) {
+    switch (c) {
+        case '(': *open = 1; return 0;
+        case ')': *open = 0; return 0;
+        case '[': *open = 1; return 1;
+        case ']': *open = 0; return 1;
+        case '{': *open = 1; return 2;
+        case '}': *open = 0; return 2;
     }
+    return -1;
 }
 
+/* Brackets of row outside strings and comments, each encoded as
+ * rx * 8 + type * 2 + open. The list is reused by the next call. */
+int *editorRowBracketList(erow *row, int *count) {
+    static int *list;
+    static int cap;
+    int n = 0, at = 0;
+
+    for (int s = 0; at < row->rsize; s++) {
+        int len = s < row->hlcount ? HL_SPAN_LEN(row->hl[s]) : row->rsize - at;
+        int hl = s < row->hlcount ? HL_SPAN_TYPE(row->hl[s]) : HL_NORMAL;
+        if (hl != HL_STRING && hl != HL_COMMENT && hl != HL_MLCOMMENT) {
+            for (int i = at; i < at + len; i++) {
+                int open, t = bracketType(row->render[i], &open);
+                if (t == -1) continue;
+                if (n == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    list = realloc(list, sizeof(int) * cap);
+                }
+                list[n++] = i * 8 + t * 2 + open;
+            }
+        }
+        at += len;
+    }
+    *count = n;
+    return list;
+}
 
-/*** File I/O ***/
+void bracketCombine(struct bracketSum *r, const struct bracketSum *a,
+                    const struct bracketSum *b) {
+    for (int t = 0; t < 3; t++) {
+        uint32_t m = a->open[t] < b->close[t] ? a->open[t] : b->close[t];
+        r->close[t] = a->close[t] + b->close[t] - m;
+        r->open[t] = a->open[t] - m + b->open[t];
+    }
+    r->stale = a->stale + b->stale;
+}
 
-char *editorRowsToString(int *buflen) {
-    int totallen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++)
-        totallen += E.row[j].size + 1;
-    *buflen = totallen;
+void bracketBlockSum(struct editorBuffer *buf, int block, struct bracketSum *out) {
+    memset(out, 0, sizeof(*out));
+    int end = (block + 1) * BRACKET_BLOCK;
+    if (end > buf->numrows) end = buf->numrows;
+    for (int i = block * BRACKET_BLOCK; i < end; i++) {
+        struct bracketSum r;
+        for (int t = 0; t < 3; t++) {
+            r.open[t] = buf->row[i].brk_open[t];
+            r.close[t] = buf->row[i].brk_close[t];
+        }
+        r.stale = (buf->row[i].flags & ROW_HL_STALE) != 0;
+        bracketCombine(out, out, &r);
+    }
+}
 
-    char *buf = malloc(totallen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].data, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+void editorBracketBuild(struct editorBuffer *buf) {
+    struct bracketTree *bt = &buf->brackets;
+    int blocks = (buf->numrows + BRACKET_BLOCK - 1) / BRACKET_BLOCK;
+    int leaves = 1;
+    while (leaves < blocks) leaves *= 2;
+    if (leaves != bt->leaves) {
+        bt->leaves = leaves;
+        bt->node = realloc(bt->node, sizeof(struct bracketSum) * 2 * leaves);
     }
-    return buf;
+    for (int i = 0; i < leaves; i++) bracketBlockSum(buf, i, &bt->node[leaves + i]);
+    for (int i = leaves - 1; i > 0; i--)
+        bracketCombine(&bt->node[i], &bt->node[2 * i], &bt->node[2 * i + 1]);
+    bt->valid = 1;
 }
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+/* Called from editorUpdateSyntax, so every rehighlighted row refreshes its
+ * counts and, once the tree has been built, the path above its block. */
+void editorRowBrackets(erow *row) {
+    int count;
+    int *list = editorRowBracketList(row, &count);
+    uint32_t open[3] = {0}, close[3] = {0};
+
+    for (int i = 0; i < count; i++) {
+        int t = (list[i] >> 1) & 3;
+        if (list[i] & 1) open[t]++;
+        else if (open[t]) open[t]--;
+        else close[t]++;
+    }
+    for (int t = 0; t < 3; t++) {
+        row->brk_open[t] = open[t] > UINT16_MAX ? UINT16_MAX : open[t];
+        row->brk_close[t] = close[t] > UINT16_MAX ? UINT16_MAX : close[t];
+    }
 
-    editorSelectSyntaxHighlight();
+    struct bracketTree *bt = &E.buf->brackets;
+    if (!bt->valid) return;
+    int node = bt->leaves + row->idx / BRACKET_BLOCK;
+    if (node >= 2 * bt->leaves) {
+        bt->valid = 0;
+        return;
+    }
+    bracketBlockSum(E.buf, row->idx / BRACKET_BLOCK, &bt->node[node]);
+    for (node /= 2; node > 0; node /= 2)
+        bracketCombine(&bt->node[node], &bt->node[2 * node], &bt->node[2 * node + 1]);
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+/* Scan row for the bracket of type t that brings *depth to zero, starting
+ * after rx going forward (dir 1) or before it going backward (dir -1). */
+int bracketScanRow(erow *row, int rx, int t, int dir, int *depth) {
+    int count;
+    int *list = editorRowBracketList(row, &count);
+    for (int k = 0; k < count; k++) {
+        int v = list[dir > 0 ? k : count - 1 - k];
+        int pos = v >> 3;
+        if (((v >> 1) & 3) != t) continue;
+        if (dir > 0 ? pos <= rx : pos >= rx) continue;
+        if ((v & 1) == (dir > 0)) (*depth)++;
+        else if (--(*depth) == 0) return pos;
+    }
+    return -1;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
+/* Walk row summaries from row r in direction dir up to (not including)
+ * row end, consuming *depth. Returns the row holding the match or -1. */
+int bracketScanRows(struct editorBuffer *buf, int r, int end, int t, int dir,
+                    int *depth) {
+    for (; r != end; r += dir) {
+        erow *row = &buf->row[r];
+        if (row->flags & ROW_HL_STALE) editorHighlightRow(buf, r);
+        int need = dir > 0 ? row->brk_close[t] : row->brk_open[t];
+        int give = dir > 0 ? row->brk_open[t] : row->brk_close[t];
+        if (need >= *depth) return r;
+        *depth += give - need;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    return -1;
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
+/* Find the first block on the dir side of block `from` whose unmatched
+ * brackets exhaust *depth, skipping whole subtrees that cannot. Subtrees
+ * holding stale rows are descended into instead, and each stale block the
+ * walk reaches is highlighted before its sum is used. */
+int bracketFindBlock(struct editorBuffer *buf, int node, int lo, int hi,
+                     int from, int t, int dir, int *depth) {
+    if (dir > 0 ? hi <= from : lo >= from) return -1;
+    if (dir > 0 ? lo >= from : hi <= from) {
+        struct bracketSum *s = &buf->brackets.node[node];
+        if (s->stale && hi - lo == 1) {
+            int end = (lo + 1) * BRACKET_BLOCK;
+            if (end > buf->numrows) end = buf->numrows;
+            for (int i = lo * BRACKET_BLOCK; i < end; i++)
+                if (buf->row[i].flags & ROW_HL_STALE) editorHighlightRow(buf, i);
         }
-        editorSelectSyntaxHighlight();
+        if (!s->stale || hi - lo == 1) {
+            long need = dir > 0 ? s->close[t] : s->open[t];
+            long give = dir > 0 ? s->open[t] : s->close[t];
+            if (need < *depth) {
+                *depth += give - need;
+                return -1;
+            }
+            if (hi - lo == 1) return lo;
+        }
+    }
+    int mid = (lo + hi) / 2;
+    int found;
+    if (dir > 0) {
+        found = bracketFindBlock(buf, 2 * node, lo, mid, from, t, dir, depth);
+        if (found == -1)
+            found = bracketFindBlock(buf, 2 * node + 1, mid, hi, from, t, dir, depth);
+    } else {
+        found = bracketFindBlock(buf, 2 * node + 1, mid, hi, from, t, dir, depth);
+        if (found == -1)
+            found = bracketFindBlock(buf, 2 * node, lo, mid, from, t, dir, depth);
     }
+    return found;
+}
 
-    int len;
-    char *buffer = editorRowsToString(&len);
+/* Find the bracket of type t closing (dir 1) or opening (dir -1) the block
+ * that contains render column rx of row r. Returns 0 and sets *outrow and
+ * *outrx on success. */
+int editorFindBracket(int r, int rx, int t, int dir, int *outrow, int *outrx) {
+    struct editorBuffer *buf = E.buf;
+    int depth = 1;
+
+    if (buf->row[r].flags & ROW_HL_STALE) editorHighlightRow(buf, r);
+    int pos = bracketScanRow(&buf->row[r], rx, t, dir, &depth);
+    if (pos == -1) {
+        int block = r / BRACKET_BLOCK;
+        int end = dir > 0 ? (block + 1) * BRACKET_BLOCK : block * BRACKET_BLOCK - 1;
+        if (end > buf->numrows) end = buf->numrows;
+        r = bracketScanRows(buf, r + dir, end, t, dir, &depth);
+        if (r == -1) {
+            if (!buf->brackets.valid) editorBracketBuild(buf);
+            block = bracketFindBlock(buf, 1, 0, buf->brackets.leaves,
+                                     dir > 0 ? block + 1 : block, t, dir, &depth);
+            if (block == -1) return -1;
+            int first = block * BRACKET_BLOCK;
+            int last = first + BRACKET_BLOCK - 1;
+            if (last >= buf->numrows) last = buf->numrows - 1;
+            r = dir > 0 ? bracketScanRows(buf, first, last + 1, t, dir, &depth)
+                        : bracketScanRows(buf, last, first - 1, t, dir, &depth);
+            if (r == -1) return -1;
+        }
+        pos = bracketScanRow(&buf->row[r], dir > 0 ? -1 : INT_MAX, t, dir, &depth);
+    }
+    if (pos == -1) return -1;
+    *outrow = r;
+    *outrx = pos;
+    return 0;
+}
+
+/* Type and direction of the bracket under the cursor, or -1. */
+int editorBracketAtCursor(int *dir) {
+    if (E.view->cy >= E.buf->numrows) return -1;
+    erow *row = &E.buf->row[E.view->cy];
+    int rx = editorRowCxToRx(row, E.view->cx);
+    int count;
+    int *list = editorRowBracketList(row, &count);
+    for (int i = 0; i < count; i++) {
+        if ((list[i] >> 3) != rx) continue;
+        *dir = (list[i] & 1) ? 1 : -1;
+        return (list[i] >> 1) & 3;
+    }
+    return -1;
+}
+
+void editorMatchBracket() {
+    int dir, t = editorBracketAtCursor(&dir);
+    if (t == -1) {
+        editorSetStatusMessage("No bracket under cursor");
+        return;
+    }
+    erow *row = &E.buf->row[E.view->cy];
+    int r, rx;
+    if (editorFindBracket(E.view->cy, editorRowCxToRx(row, E.view->cx), t, dir,
+                          &r, &rx) == -1) {
+        editorSetStatusMessage("Unmatched bracket");
+        return;
+    }
+    E.view->cy = r;
+    E.view->cx = editorRowRxToCx(&E.buf->row[r], rx);
+}
+
+/* Move to the '{' opening the block around the cursor; repeating the
+ * command walks outward. */
+void editorEnclosingBlock() {
+    if (E.view->cy >= E.buf->numrows) return;
+    erow *row = &E.buf->row[E.view->cy];
+    int r, rx;
+    if (editorFindBracket(E.view->cy, editorRowCxToRx(row, E.view->cx), 2, -1,
+                          &r, &rx) == -1) {
+        editorSetStatusMessage("No enclosing block");
+        return;
+    }
+    E.view->cy = r;
+    E.view->cx = editorRowRxToCx(&E.buf->row[r], rx);
+}
+
+void editorUpdateBracketMatch() {
+    int dir, t = editorBracketAtCursor(&dir);
+    int r = -1, rx = 0;
+    if (t != -1 && !E.buf->stale) {
+        erow *row = &E.buf->row[E.view->cy];
+        if (editorFindBracket(E.view->cy, editorRowCxToRx(row, E.view->cx), t, dir,
+                              &r, &rx) == -1)
+            r = -1;
+    }
+    if (r == -1) {
+        editorSetOverlay(OVERLAY_BRACKET, -1, 0, 0, HL_NORMAL);
+        editorSetOverlay(OVERLAY_BRACKET_MATCH, -1, 0, 0, HL_NORMAL);
+        return;
+    }
+    editorSetOverlay(OVERLAY_BRACKET, E.view->cy, E.view->rx, 1, HL_BRACKET);
+    editorSetOverlay(OVERLAY_BRACKET_MATCH, r, rx, 1, HL_BRACKET);
+}
+
+/*** Undo ***/
+
+#define UNDO_ALIGN(n) (((n) + 3) & ~(size_t)3)
+#define UNDO_RECLEN(len) UNDO_ALIGN(sizeof(struct undoRecord) + (len) + sizeof(uint32_t))
+
+struct undoRecord *undoRecordBefore(struct undoLog *u, size_t end) {
+    uint32_t reclen;
+    memcpy(&reclen, &u->buf[end - sizeof(uint32_t)], sizeof(uint32_t));
+    return (struct undoRecord *)&u->buf[end - reclen];
+}
+
+void undoWriteFooter(struct undoRecord *rec) {
+    uint32_t reclen = UNDO_RECLEN(rec->len);
+    memcpy((char *)rec + reclen - sizeof(uint32_t), &reclen, sizeof(uint32_t));
+}
+
+void editorUndoReset() {
+    free(E.buf->undo.buf);
+    E.buf->undo.buf = NULL;
+    E.buf->undo.head = E.buf->undo.top = E.buf->undo.cap = 0;
+    E.buf->undo.sealed = 1;
+}
+
+int undoReserve(struct undoLog *u, size_t need) {
+    if (need > u->limit) return -1;
+
+    if (u->top + need > u->limit) {
+        size_t drop = 0;
+        size_t want = u->top + need - u->limit;
+        if (want < u->limit / 4) want = u->limit / 4;
+        while (drop < u->head) {
+            struct undoRecord *rec = (struct undoRecord *)&u->buf[drop];
+            uint32_t group = rec->group;
+            if (group == u->group) break;
+            drop += UNDO_RECLEN(rec->len);
+            while (drop < u->head &&
+                   ((struct undoRecord *)&u->buf[drop])->group == group)
+                drop += UNDO_RECLEN(((struct undoRecord *)&u->buf[drop])->len);
+            if (drop >= want) break;
+        }
+        memmove(u->buf, &u->buf[drop], u->top - drop);
+        u->head -= drop;
+        u->top -= drop;
+        if (u->top + need > u->limit) return -1;
+    }
+
+    if (u->top + need > u->cap) {
+        size_t cap = u->cap ? u->cap * 2 : 4096;
+        while (cap < u->top + need) cap *= 2;
+        if (cap > u->limit) cap = u->limit;
+        char *buf = realloc(u->buf, cap);
+        if (buf == NULL) return -1;
+        u->buf = buf;
+        u->cap = cap;
+    }
+    return 0;
+}
+
+int undoCoalesce(struct undoLog *u, int op, int row, int col, const char *s, int len) {
+    if (u->sealed || u->head == 0 || u->head != u->top) return 0;
+
+    struct undoRecord *rec = undoRecordBefore(u, u->head);
+    if ((int)rec->op != op || rec->row != row) return 0;
+
+    int append;
+    if (op == UNDO_INSERT && rec->col + (int)rec->len == col) append = 1;
+    else if (op == UNDO_DELETE && rec->col == col) append = 1;
+    else if (op == UNDO_DELETE && col + len == rec->col) append = 0;
+    else return 0;
+
+    size_t offset = (char *)rec - u->buf;
+    size_t oldlen = UNDO_RECLEN(rec->len);
+    size_t newlen = UNDO_RECLEN(rec->len + len);
+    size_t head = u->head;
+    if (newlen > oldlen && undoReserve(u, newlen - oldlen) == -1) return 0;
+    if (head - u->head > offset) return 0;
+    offset -= head - u->head;
+    rec = (struct undoRecord *)&u->buf[offset];
+
+    char *payload = (char *)(rec + 1);
+    if (append) {
+        memcpy(&payload[rec->len], s, len);
+    } else {
+        memmove(&payload[len], payload, rec->len);
+        memcpy(payload, s, len);
+        rec->col = col;
+    }
+    rec->len += len;
+    rec->group = u->group;
+    undoWriteFooter(rec);
+    u->head = u->top = offset + newlen;
+    return 1;
+}
+
+void editorUndoRecord(int op, int row, int col, const char *s, int len) {
+    struct undoLog *u = &E.buf->undo;
+    if (u->suspended) return;
+    if (u->group == u->skipgroup) return;
+
+    if (undoCoalesce(u, op, row, col, s, len)) return;
+
+    u->top = u->head;
+    if (undoReserve(u, UNDO_RECLEN(len)) == -1) {
+        editorUndoReset();
+        u->skipgroup = u->group;
+        editorSetStatusMessage("Edit too large to undo; undo history cleared");
+        return;
+    }
+
+    struct undoRecord *rec = (struct undoRecord *)&u->buf[u->top];
+    rec->group = u->group;
+    rec->op = op;
+    rec->row = row;
+    rec->col = col;
+    rec->len = len;
+    memcpy(rec + 1, s, len);
+    undoWriteFooter(rec);
+    u->head = u->top += UNDO_RECLEN(len);
+    u->sealed = 0;
+}
+
+void editorUndoBeginGroup() {
+    E.buf->undo.group++;
+}
+
+void editorUndoSeal() {
+    E.buf->undo.sealed = 1;
+}
+
+void undoApply(struct undoRecord *rec, int inverse) {
+    int op = rec->op;
+    if (inverse) {
+        switch (op) {
+            case UNDO_INSERT: op = UNDO_DELETE; break;
+            case UNDO_DELETE: op = UNDO_INSERT; break;
+            case UNDO_INSERT_ROW: op = UNDO_DELETE_ROW; break;
+            case UNDO_DELETE_ROW: op = UNDO_INSERT_ROW; break;
+        }
+    }
+
+    char *payload = (char *)(rec + 1);
+    switch (op) {
+        case UNDO_INSERT:
+            editorRowInsertString(&E.buf->row[rec->row], rec->col, payload, rec->len);
+            E.view->cx = rec->col + (inverse ? 0 : rec->len);
+            break;
+        case UNDO_DELETE:
+            editorRowDelString(&E.buf->row[rec->row], rec->col, rec->len);
+            E.view->cx = rec->col;
+            break;
+        case UNDO_INSERT_ROW:
+            editorInsertRow(rec->row, payload, rec->len);
+            E.view->cx = 0;
+            break;
+        case UNDO_DELETE_ROW:
+            editorDelRow(rec->row);
+            E.view->cx = 0;
+            break;
+    }
+    E.view->cy = rec->row;
+    if (E.view->cy > E.buf->numrows) E.view->cy = E.buf->numrows;
+    if (E.view->cy < E.buf->numrows && E.view->cx > E.buf->row[E.view->cy].size) E.view->cx = E.buf->row[E.view->cy].size;
+}
+
+void editorUndo() {
+    struct undoLog *u = &E.buf->undo;
+    if (u->head == 0) {
+        editorSetStatusMessage("Already at oldest change");
+        return;
+    }
+
+    uint32_t group = undoRecordBefore(u, u->head)->group;
+    u->suspended++;
+    while (u->head > 0) {
+        struct undoRecord *rec = undoRecordBefore(u, u->head);
+        if (rec->group != group) break;
+        undoApply(rec, 1);
+        u->head -= UNDO_RECLEN(rec->len);
+    }
+    u->suspended--;
+    u->sealed = 1;
+}
+
+void editorRedo() {
+    struct undoLog *u = &E.buf->undo;
+    if (u->head == u->top) {
+        editorSetStatusMessage("Already at newest change");
+        return;
+    }
+
+    uint32_t group = ((struct undoRecord *)&u->buf[u->head])->group;
+    u->suspended++;
+    while (u->head < u->top) {
+        struct undoRecord *rec = (struct undoRecord *)&u->buf[u->head];
+        if (rec->group != group) break;
+        undoApply(rec, 0);
+        u->head += UNDO_RECLEN(rec->len);
+    }
+    u->suspended--;
+    u->sealed = 1;
+}
+
+/*** Journal ***/
+
+#define JOURNAL_MAGIC "TESWP001"
+#define JOURNAL_HEADER_SIZE 32
+#define JOURNAL_RECORD_SIZE 13
+
+long long editorNowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+char *editorJournalPath(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+    size_t len = strlen(filename) + 9;
+    char *path = malloc(len);
+    snprintf(path, len, "%.*s.%s.te-swp", dirlen, filename, filename + dirlen);
+    return path;
+}
+
+void journalEncodeHeader(char *header, struct stat *st) {
+    int64_t size = st->st_size;
+    int64_t sec = st->st_mtim.tv_sec;
+    int64_t nsec = st->st_mtim.tv_nsec;
+    memcpy(header, JOURNAL_MAGIC, 8);
+    memcpy(header + 8, &size, 8);
+    memcpy(header + 16, &sec, 8);
+    memcpy(header + 24, &nsec, 8);
+}
+
+int editorJournalFlush() {
+    struct editorJournal *j = &E.buf->journal;
+    if (j->fd == -1 || j->len == 0) return 0;
+
+    size_t done = 0;
+    while (done < j->len) {
+        ssize_t n = write(j->fd, j->buf + done, j->len - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            editorSetStatusMessage("Swap file write failed: %s; journaling off",
+                                   strerror(errno));
+            close(j->fd);
+            j->fd = -1;
+            j->len = 0;
+            return -1;
+        }
+        done += n;
+    }
+    j->len = 0;
+    fdatasync(j->fd);
+    return 0;
+}
+
+int journalCoalesce(struct editorJournal *j, int op, int row, int col,
+                    const char *s, int len) {
+    if (j->len == 0 || (op != UNDO_INSERT && op != UNDO_DELETE)) return 0;
+
+    char *p = j->buf + j->last;
+    int32_t fields[3];
+    memcpy(fields, p + 1, sizeof(fields));
+    if (p[0] != op || fields[0] != row) return 0;
+
+    char *payload = p + JOURNAL_RECORD_SIZE;
+    if (op == UNDO_INSERT && fields[1] + fields[2] == col) {
+        memcpy(payload + fields[2], s, len);
+    } else if (op == UNDO_DELETE && fields[1] == col) {
+        memcpy(payload + fields[2], s, len);
+    } else if (op == UNDO_DELETE && col + len == fields[1]) {
+        memmove(payload + len, payload, fields[2]);
+        memcpy(payload, s, len);
+        fields[1] = col;
+    } else {
+        return 0;
+    }
+    fields[2] += len;
+    memcpy(p + 1, fields, sizeof(fields));
+    j->len += len;
+    return 1;
+}
+
+void editorJournalRecord(int op, int row, int col, const char *s, int len) {
+    struct editorJournal *j = &E.buf->journal;
+    if (j->fd == -1 || j->suspended) return;
+
+    size_t need = j->len + JOURNAL_RECORD_SIZE + len;
+    if (need > j->cap) {
+        size_t cap = j->cap ? j->cap : JOURNAL_FLUSH_BYTES;
+        while (cap < need) cap *= 2;
+        char *buf = realloc(j->buf, cap);
+        if (buf == NULL) return;
+        j->buf = buf;
+        j->cap = cap;
+    }
+
+    if (j->len == 0) j->pending_since = editorNowMs();
+    if (!journalCoalesce(j, op, row, col, s, len)) {
+        char *p = j->buf + j->len;
+        int32_t fields[3] = {row, col, len};
+        p[0] = op;
+        memcpy(p + 1, fields, sizeof(fields));
+        memcpy(p + JOURNAL_RECORD_SIZE, s, len);
+        j->last = j->len;
+        j->len = need;
+    }
+
+    if (j->len >= JOURNAL_FLUSH_BYTES ||
+        editorNowMs() - j->pending_since >= JOURNAL_MAX_DELAY_MS)
+        editorJournalFlush();
+}
+
+void editorJournalFlushBuffer(struct editorBuffer *buf) {
+    struct editorBuffer *cur = E.buf;
+    E.buf = buf;
+    editorJournalFlush();
+    E.buf = cur;
+}
+
+void editorJournalIdle() {
+    long long now = editorNowMs();
+    for (int i = 0; i < E.numbuffers; i++) {
+        struct editorJournal *j = &E.buffers[i]->journal;
+        if (j->len && now - j->pending_since >= JOURNAL_FLUSH_MS)
+            editorJournalFlushBuffer(E.buffers[i]);
+    }
+}
+
+int editorJournalReset() {
+    struct editorJournal *j = &E.buf->journal;
+    if (j->fd == -1) return -1;
+
+    struct stat st;
+    char header[JOURNAL_HEADER_SIZE];
+    if (stat(E.buf->filename, &st) == -1) return -1;
+    journalEncodeHeader(header, &st);
+
+    j->len = 0;
+    if (ftruncate(j->fd, 0) == -1 ||
+        pwrite(j->fd, header, sizeof(header), 0) != sizeof(header))
+        return -1;
+    lseek(j->fd, 0, SEEK_END);
+    fdatasync(j->fd);
+    return 0;
+}
+
+int editorJournalReplay(const char *data, size_t size) {
+    struct editorSyntax *syntax = E.buf->syntax;
+    E.buf->syntax = NULL;
+    E.buf->undo.suspended++;
+    E.buf->journal.suspended++;
+
+    int applied = 0;
+    size_t at = JOURNAL_HEADER_SIZE;
+    while (at + JOURNAL_RECORD_SIZE <= size) {
+        int32_t fields[3];
+        int op = data[at];
+        memcpy(fields, data + at + 1, sizeof(fields));
+        int row = fields[0], col = fields[1], len = fields[2];
+        const char *payload = data + at + JOURNAL_RECORD_SIZE;
+        if (len < 0 || (size_t)len > size - at - JOURNAL_RECORD_SIZE) break;
+
+        if (op == UNDO_INSERT_ROW && row >= 0 && row <= E.buf->numrows) {
+            editorInsertRow(row, (char *)payload, len);
+        } else if (op == UNDO_DELETE_ROW && row >= 0 && row < E.buf->numrows) {
+            editorDelRow(row);
+        } else if (op == UNDO_INSERT && row >= 0 && row < E.buf->numrows) {
+            editorRowInsertString(&E.buf->row[row], col, payload, len);
+        } else if (op == UNDO_DELETE && row >= 0 && row < E.buf->numrows) {
+            editorRowDelString(&E.buf->row[row], col, len);
+        } else {
+            break;
+        }
+        applied++;
+        at += JOURNAL_RECORD_SIZE + len;
+    }
+
+    E.buf->journal.suspended--;
+    E.buf->undo.suspended--;
+    E.buf->syntax = syntax;
+    if (applied) editorSelectSyntaxHighlight();
+    return applied;
+}
+
+void editorJournalOpen() {
+    struct editorJournal *j = &E.buf->journal;
+    struct stat st;
+    if (E.buf->filename == NULL || stat(E.buf->filename, &st) == -1) return;
+
+    free(j->path);
+    j->path = editorJournalPath(E.buf->filename);
+
+    char header[JOURNAL_HEADER_SIZE];
+    journalEncodeHeader(header, &st);
+
+    int recovered = 0;
+    int fd = open(j->path, O_RDONLY);
+    if (fd != -1) {
+        struct stat swp;
+        char *data = NULL;
+        if (fstat(fd, &swp) == 0 && swp.st_size > JOURNAL_HEADER_SIZE) {
+            data = malloc(swp.st_size);
+            if (data && read(fd, data, swp.st_size) == swp.st_size &&
+                !memcmp(data, header, JOURNAL_HEADER_SIZE)) {
+                recovered = editorJournalReplay(data, swp.st_size);
+            }
+        }
+        free(data);
+        close(fd);
+    }
+
+    if (recovered) {
+        j->fd = open(j->path, O_WRONLY | O_APPEND);
+        editorSetStatusMessage("Recovered %d edits from %s", recovered, j->path);
+        return;
+    }
+
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (j->fd == -1) return;
+    if (write(j->fd, header, sizeof(header)) != sizeof(header)) {
+        close(j->fd);
+        j->fd = -1;
+    }
+}
+
+void editorJournalClose() {
+    struct editorJournal *j = &E.buf->journal;
+    if (j->fd != -1) {
+        close(j->fd);
+        unlink(j->path);
+    }
+    j->fd = -1;
+    j->len = 0;
+}
+
+void editorJournalSignal(int sig) {
+    for (int i = 0; i < E.numbuffers; i++) {
+        struct editorJournal *j = &E.buffers[i]->journal;
+        if (j->fd != -1 && j->len) {
+            if (write(j->fd, j->buf, j->len) > 0) fdatasync(j->fd);
+        }
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/** Editor Operations ***/
+
+void editorInsertChar(int c) {
+    if (E.view->cy == E.buf->numrows) {
+        editorInsertRow(E.buf->numrows, "", 0);
+    }
+    editorRowInsertChar(&E.buf->row[E.view->cy], E.view->cx, c);
+    E.view->cx++;
+}
+
+void editorInsertNewline() {
+    if (E.view->cx == 0) {
+        editorInsertRow(E.view->cy, "", 0);
+    } else {
+        erow *row = &E.buf->row[E.view->cy];
+        editorInsertRow(E.view->cy + 1, &row->data[E.view->cx], row->size - E.view->cx);
+        editorRowTruncate(&E.buf->row[E.view->cy], E.view->cx);
+    }
+    E.view->cy++;
+    E.view->cx = 0;
+}
+
+void editorDelChar() {
+    if (E.view->cy == E.buf->numrows) return;
+    if (E.view->cx == 0 && E.view->cy == 0) return;
+
+    erow *row = &E.buf->row[E.view->cy];
+    if (E.view->cx > 0) {
+        editorRowDelChar(row, E.view->cx - 1);
+        E.view->cx--;
+    } else {
+        E.view->cx = E.buf->row[E.view->cy - 1].size;
+        editorRowAppendString(&E.buf->row[E.view->cy - 1], row->data, row->size);
+        editorDelRow(E.view->cy);
+        E.view->cy--;
+    }
+}
+
+
+void editorComplete() {
+    struct editorCompletion *cp = &E.complete;
+    if (E.view->cy >= E.buf->numrows) return;
+    erow *row = &E.buf->row[E.view->cy];
+
+    if (cp->count == 0) {
+        int start = E.view->cx;
+        while (start > 0 && is_word_char(row->data[start - 1])) start--;
+        cp->row = E.view->cy;
+        cp->col = start;
+        cp->prefixlen = E.view->cx - start;
+        cp->inserted = 0;
+        cp->next = 0;
+        if (cp->prefixlen == 0 ||
+            !wordIndexComplete(&E.buf->words, &row->data[start], cp->prefixlen, cp)) {
+            editorSetStatusMessage("No completions");
+            return;
+        }
+    }
+
+    int at = cp->col + cp->prefixlen;
+    if (cp->inserted) editorRowDelString(row, at, cp->inserted);
+    if (cp->next == cp->count) {
+        cp->inserted = cp->next = 0;
+        E.view->cx = at;
+        editorSetStatusMessage("Back at original");
+        return;
+    }
+
+    const char *word = cp->words[cp->next++] + cp->prefixlen;
+    cp->inserted = strlen(word);
+    editorRowInsertString(row, at, word, cp->inserted);
+    E.view->cx = at + cp->inserted;
+    editorSetStatusMessage("Completion %d of %d%s", cp->next, cp->count,
+                           cp->count == COMPLETE_MAX ? "+" : "");
+}
+
+/*** File Watching ***/
+
+void editorWatchRemove(struct editorBuffer *buf) {
+    int wd = buf->watch.wd;
+    buf->watch.wd = -1;
+    if (wd == -1) return;
+    for (int i = 0; i < E.numbuffers; i++)
+        if (E.buffers[i]->watch.wd == wd) return;
+    inotify_rm_watch(E.inotify, wd);
+}
+
+void editorWatchFile() {
+    struct editorBuffer *buf = E.buf;
+    struct stat st;
+
+    editorWatchRemove(buf);
+    if (E.inotify == -1 || buf->filename == NULL) return;
+    if (stat(buf->filename, &st) == -1 || !S_ISREG(st.st_mode)) return;
+
+    buf->watch.wd = inotify_add_watch(E.inotify, buf->filename,
+      IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+    buf->watch.size = st.st_size;
+    buf->watch.mtime = st.st_mtim;
+    buf->partial = 0;
+
+    char last;
+    int fd = open(buf->filename, O_RDONLY);
+    if (fd != -1) {
+        if (st.st_size > 0 && pread(fd, &last, 1, st.st_size - 1) == 1)
+            buf->partial = last != '\n';
+        close(fd);
+    }
+}
+
+/* Split data into rows the same way editorOpen does; the last row is
+ * returned even when it has no trailing newline. */
+struct rowText *editorSplitText(const char *data, size_t len, int *count) {
+    int n = 0, cap = 0;
+    struct rowText *text = NULL;
+    const char *p = data, *end = data + len;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *e = nl ? nl : end;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            text = realloc(text, sizeof(struct rowText) * cap);
+        }
+        text[n].s = p;
+        text[n].len = e - p;
+        if (nl && text[n].len && e[-1] == '\r') text[n].len--;
+        n++;
+        p = nl ? nl + 1 : end;
+    }
+    *count = n;
+    return text;
+}
+
+int editorWatchIsAppend(struct editorBuffer *buf, int fd, struct stat *st) {
+    if (st->st_size <= buf->watch.size) return 0;
+    if (buf->numrows == 0) return buf->watch.size == 0;
+
+    erow *last = &buf->row[buf->numrows - 1];
+    int len = last->size + !buf->partial;
+    off_t at = buf->watch.size - len;
+    if (at < 0) return 0;
+
+    char *tail = malloc(len);
+    int same = pread(fd, tail, len, at) == len &&
+               !memcmp(tail, last->data, last->size) &&
+               (buf->partial || tail[last->size] == '\n');
+    free(tail);
+    return same;
+}
+
+void editorAppendText(const char *data, size_t len) {
+    struct editorBuffer *buf = E.buf;
+    int count;
+    struct rowText *text = editorSplitText(data, len, &count);
+
+    int first = 0;
+    if (buf->partial && buf->numrows) {
+        erow *last = &buf->row[buf->numrows - 1];
+        editorRowInsertString(last, last->size, text[0].s, text[0].len);
+        first = 1;
+    }
+    editorSpliceRows(buf->numrows, 0, text + first, count - first);
+    free(text);
+
+    buf->partial = data[len - 1] != '\n';
+    if (!buf->partial && buf->numrows) {
+        erow *last = &buf->row[buf->numrows - 1];
+        if (last->size && last->data[last->size - 1] == '\r')
+            editorRowDelString(last, last->size - 1, 1);
+    }
+}
+
+void editorWatchAppend(struct editorBuffer *buf, int fd, struct stat *st) {
+    char *chunk = malloc(WATCH_CHUNK_SIZE);
+    off_t at = buf->watch.size;
+
+    while (at < st->st_size) {
+        ssize_t len = pread(fd, chunk, WATCH_CHUNK_SIZE, at);
+        if (len <= 0) break;
+        at += len;
+        editorAppendText(chunk, len);
+    }
+    free(chunk);
+}
+
+int editorWatchReload(struct editorBuffer *buf, int fd, struct stat *st) {
+    char *data = NULL;
+    if (st->st_size > 0) {
+        data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) return 0;
+    }
+
+    int count;
+    struct rowText *text = editorSplitText(data, st->st_size, &count);
+
+    int top = 0, bottom = 0;
+    while (top < count && top < buf->numrows &&
+           text[top].len == (size_t)buf->row[top].size &&
+           !memcmp(text[top].s, buf->row[top].data, text[top].len))
+        top++;
+    while (bottom < count - top && bottom < buf->numrows - top) {
+        struct rowText *t = &text[count - 1 - bottom];
+        erow *row = &buf->row[buf->numrows - 1 - bottom];
+        if (t->len != (size_t)row->size || memcmp(t->s, row->data, t->len)) break;
+        bottom++;
+    }
+
+    int del = buf->numrows - top - bottom;
+    int ins = count - top - bottom;
+    if (del || ins) {
+        editorSpliceRows(top, del, text + top, ins);
+        editorUndoReset();
+    }
+
+    free(text);
+    if (data) munmap(data, st->st_size);
+    return del || ins;
+}
+
+void editorWatchFollow(struct editorBuffer *buf) {
+    for (int i = 0; i < E.numviews; i++) {
+        struct editorView *view = E.views[i];
+        if (view->buf != buf) continue;
+        view->cy = buf->numrows > 0 ? buf->numrows - 1 : 0;
+        view->cx = 0;
+        view->rowoffset = view->cy - view->rows + 1;
+        if (view->rowoffset < 0) view->rowoffset = 0;
+        view->subrow = 0;
+    }
+}
+
+int editorWatchUpdate(struct editorBuffer *buf, int replaced) {
+    struct stat st;
+    if (replaced) editorWatchRemove(buf);
+    if (stat(buf->filename, &st) == -1) {
+        editorSetStatusMessage("%s was removed on disk", buf->filename);
+        return 0;
+    }
+    if (!replaced && st.st_size == buf->watch.size &&
+        st.st_mtim.tv_sec == buf->watch.mtime.tv_sec &&
+        st.st_mtim.tv_nsec == buf->watch.mtime.tv_nsec)
+        return 0;
+
+    int fd = open(buf->filename, O_RDONLY);
+    if (fd == -1) return 0;
+
+    struct editorBuffer *cur = E.buf;
+    E.buf = buf;
+    int changed = 0, appended = 0;
+    if (buf->dirty) {
+        editorSetStatusMessage("%s changed on disk", buf->filename);
+        changed = 1;
+    } else {
+        buf->undo.suspended++;
+        buf->journal.suspended++;
+        if (editorWatchIsAppend(buf, fd, &st)) {
+            editorWatchAppend(buf, fd, &st);
+            changed = appended = 1;
+        } else {
+            changed = editorWatchReload(buf, fd, &st);
+        }
+        buf->journal.suspended--;
+        buf->undo.suspended--;
+        buf->dirty = 0;
+        editorJournalReset();
+    }
+    close(fd);
+
+    if (replaced || !appended) {
+        editorWatchFile();
+    } else {
+        buf->watch.size = st.st_size;
+        buf->watch.mtime = st.st_mtim;
+    }
+    E.buf = cur;
+    if (!changed) return 0;
+
+    if (buf->follow) editorWatchFollow(buf);
+    editorClampCursor(buf, &buf->cy, &buf->cx);
+    for (int i = 0; i < E.numviews; i++)
+        if (E.views[i]->buf == buf)
+            editorClampCursor(buf, &E.views[i]->cy, &E.views[i]->cx);
+    return 1;
+}
+
+int editorWatchPoll() {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t len;
+
+    if (E.inotify == -1) return 0;
+    while ((len = read(E.inotify, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + len;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            int replaced = (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) != 0;
+            for (int i = 0; i < E.numbuffers; i++) {
+                struct editorBuffer *buf = E.buffers[i];
+                if (buf->watch.wd == ev->wd && buf->filename)
+                    changed += editorWatchUpdate(buf, replaced);
+            }
+        }
+    }
+    return changed;
+}
+
+/*** Streams ***/
+
+int editorStreamOpen() {
+    if (isatty(STDIN_FILENO)) {
+        fprintf(stderr, "TE: stdin is a terminal, nothing to read\n");
+        exit(1);
+    }
+
+    int fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) die("/dev/tty");
+    close(tty);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+void editorStreamTrim(struct editorBuffer *buf) {
+    int drop = buf->numrows - buf->maxrows;
+    if (buf->maxrows <= 0 || drop <= buf->maxrows / 8) return;
+
+    editorSpliceRows(0, drop, NULL, 0);
+    editorUndoReset();
+    buf->cy = buf->cy > drop ? buf->cy - drop : 0;
+    buf->rowoffset = buf->rowoffset > drop ? buf->rowoffset - drop : 0;
+    editorClampCursor(buf, &buf->cy, &buf->cx);
+    for (int i = 0; i < E.numviews; i++) {
+        struct editorView *view = E.views[i];
+        if (view->buf != buf) continue;
+        view->cy = view->cy > drop ? view->cy - drop : 0;
+        view->rowoffset = view->rowoffset > drop ? view->rowoffset - drop : 0;
+        editorClampCursor(buf, &view->cy, &view->cx);
+        for (int o = 0; o < OVERLAY_SLOTS; o++) view->overlay[o].row = -1;
+    }
+}
+
+int editorStreamPoll() {
+    static char chunk[STREAM_CHUNK_SIZE];
+    int changed = 0;
+
+    for (int i = 0; i < E.numbuffers; i++) {
+        struct editorBuffer *buf = E.buffers[i];
+        if (buf->stream == -1) continue;
+
+        struct editorBuffer *cur = E.buf;
+        int dirty = buf->dirty;
+        size_t total = 0;
+        ssize_t len = -1;
+        E.buf = buf;
+        buf->undo.suspended++;
+        while (total < STREAM_BATCH_BYTES &&
+               (len = read(buf->stream, chunk, sizeof(chunk))) > 0) {
+            editorAppendText(chunk, len);
+            editorStreamTrim(buf);
+            total += len;
+        }
+        buf->undo.suspended--;
+        buf->dirty = dirty;
+        E.buf = cur;
+
+        if (len == 0 || (len == -1 && errno != EAGAIN)) {
+            close(buf->stream);
+            buf->stream = -1;
+            editorSetStatusMessage("stdin: end of stream");
+            changed++;
+        }
+        if (total) {
+            if (buf->follow) editorWatchFollow(buf);
+            changed++;
+        }
+    }
+    return changed;
+}
+
+void editorToggleFollow() {
+    E.buf->follow = !E.buf->follow;
+    if (E.buf->follow) editorWatchFollow(E.buf);
+    editorSetStatusMessage("Follow mode %s", E.buf->follow ? "on" : "off");
+}
+
+/*** Cache ***/
+
+#define CACHE_MAGIC "TEIDX001"
+#define CACHE_BLOCK 64
+#define CACHE_MIN_BYTES (1024 * 1024)
+#define CACHE_SAMPLES 16
+#define CACHE_SAMPLE_SIZE 4096
+#define CACHE_IDLE_US 20000
+#define CACHE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/* On-disk layout, native endian: header, path padded to 8 bytes, the
+ * offset of each row's newline, then the open comment state at the start
+ * of every CACHE_BLOCK rows. */
+struct cacheHeader {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+    char filetype[16];
+    uint32_t numrows;
+    uint32_t block;
+    uint32_t pathlen;
+    uint32_t pad;
+};
+
+struct cacheWriter {
+    pthread_t thread;
+    int running;
+    int registered;
+} cacheWriter;
+
+struct cacheJob {
+    char *path;
+    char *filepath;
+    struct cacheHeader hdr;
+    uint64_t *ends;
+    unsigned char *checkpoints;
+};
+
+uint64_t cacheFnv(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Hash the size and a handful of blocks spread over the file, enough to
+ * catch a rewrite that kept size and mtime without reading all of it. */
+uint64_t editorCacheHash(int fd, off_t size) {
+    char sample[CACHE_SAMPLE_SIZE];
+    uint64_t h = cacheFnv(14695981039346656037ULL, &size, sizeof(size));
+    off_t span = size > CACHE_SAMPLE_SIZE ? size - CACHE_SAMPLE_SIZE : 0;
+    for (int i = 0; i < CACHE_SAMPLES; i++) {
+        ssize_t n = pread(fd, sample, sizeof(sample), span * i / (CACHE_SAMPLES - 1));
+        if (n > 0) h = cacheFnv(h, sample, n);
+    }
+    return h;
+}
+
+/* Sidecar path for filename under $TE_CACHE_DIR, $XDG_CACHE_HOME/te or
+ * ~/.cache/te. An empty TE_CACHE_DIR turns the cache off. */
+char *editorCachePath(const char *filename, char **filepath) {
+    char dir[PATH_MAX];
+    const char *env = getenv("TE_CACHE_DIR");
+    *filepath = NULL;
+    if (env) {
+        if (*env == '\0') return NULL;
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+        snprintf(dir, sizeof(dir), "%s/te", env);
+    } else if ((env = getenv("HOME")) && *env) {
+        snprintf(dir, sizeof(dir), "%s/.cache", env);
+        mkdir(dir, 0700);
+        snprintf(dir, sizeof(dir), "%s/.cache/te", env);
+    } else {
+        return NULL;
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) return NULL;
+
+    *filepath = realpath(filename, NULL);
+    if (*filepath == NULL) return NULL;
+    uint64_t h = cacheFnv(14695981039346656037ULL, *filepath, strlen(*filepath));
+    char *path = malloc(strlen(dir) + 22);
+    sprintf(path, "%s/%016llx.idx", dir, (unsigned long long)h);
+    return path;
+}
+
+void cacheFillHeader(struct cacheHeader *hdr, struct stat *st, int numrows,
+                     const char *filepath) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, CACHE_MAGIC, 8);
+    hdr->size = st->st_size;
+    hdr->mtime_sec = st->st_mtim.tv_sec;
+    hdr->mtime_nsec = st->st_mtim.tv_nsec;
+    if (E.buf->syntax)
+        snprintf(hdr->filetype, sizeof(hdr->filetype), "%s", E.buf->syntax->filetype);
+    hdr->numrows = numrows;
+    hdr->block = CACHE_BLOCK;
+    hdr->pathlen = strlen(filepath);
+}
+
+void *editorCacheWriter(void *arg) {
+    struct cacheJob *job = arg;
+    static const char zero[8];
+    size_t pad = CACHE_ALIGN(job->hdr.pathlen) - job->hdr.pathlen;
+    size_t endslen = sizeof(uint64_t) * job->hdr.numrows;
+    size_t cplen = job->hdr.numrows / CACHE_BLOCK + 1;
+
+    size_t tmplen = strlen(job->path) + 32;
+    char *tmp = malloc(tmplen);
+    snprintf(tmp, tmplen, "%s.%d.tmp", job->path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd != -1) {
+        int ok = write(fd, &job->hdr, sizeof(job->hdr)) == sizeof(job->hdr) &&
+                 write(fd, job->filepath, job->hdr.pathlen) == job->hdr.pathlen &&
+                 write(fd, zero, pad) == (ssize_t)pad &&
+                 write(fd, job->ends, endslen) == (ssize_t)endslen &&
+                 write(fd, job->checkpoints, cplen) == (ssize_t)cplen;
+        close(fd);
+        if (!ok || rename(tmp, job->path) == -1) unlink(tmp);
+    }
+
+    free(tmp);
+    free(job->path);
+    free(job->filepath);
+    free(job->ends);
+    free(job->checkpoints);
+    free(job);
+    return NULL;
+}
+
+void editorCacheWait() {
+    if (!cacheWriter.running) return;
+    pthread_join(cacheWriter.thread, NULL);
+    cacheWriter.running = 0;
+}
+
+/* Hand the row index of a freshly read buffer to a thread that writes the
+ * sidecar; exit waits for it. Takes ownership of ends. */
+void editorCacheStore(const char *filename, int fd, struct stat *st, uint64_t *ends) {
+    struct cacheJob *job = calloc(1, sizeof(struct cacheJob));
+    job->path = editorCachePath(filename, &job->filepath);
+    if (job->path == NULL) {
+        free(job->filepath);
+        free(job);
+        free(ends);
+        return;
+    }
+
+    int numrows = E.buf->numrows;
+    cacheFillHeader(&job->hdr, st, numrows, job->filepath);
+    job->hdr.hash = editorCacheHash(fd, st->st_size);
+    job->ends = ends;
+    job->checkpoints = calloc(numrows / CACHE_BLOCK + 1, 1);
+    for (int k = 1; k <= numrows / CACHE_BLOCK; k++)
+        job->checkpoints[k] = E.buf->row[k * CACHE_BLOCK - 1].hl_open_comment;
+
+    editorCacheWait();
+    if (pthread_create(&cacheWriter.thread, NULL, editorCacheWriter, job) == 0) {
+        cacheWriter.running = 1;
+        if (!cacheWriter.registered++) atexit(editorCacheWait);
+    } else {
+        editorCacheWriter(job);
+    }
+}
+
+/* Build the rows straight from a matching sidecar without scanning for
+ * newlines. Highlighting is deferred: rows are marked stale and the block
+ * checkpoints let any of them be highlighted without starting at row 0. */
+int editorCacheLoad(const char *filename, int fd, struct stat *st) {
+    char *filepath;
+    char *path = editorCachePath(filename, &filepath);
+    if (path == NULL) {
+        free(filepath);
+        return 0;
+    }
+
+    struct stat cst;
+    void *map = MAP_FAILED;
+    int cfd = open(path, O_RDONLY);
+    free(path);
+    if (cfd != -1) {
+        if (fstat(cfd, &cst) == 0 && cst.st_size >= (off_t)sizeof(struct cacheHeader))
+            map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+        close(cfd);
+    }
+    if (map == MAP_FAILED) {
+        free(filepath);
+        return 0;
+    }
+
+    int loaded = 0;
+    char *data = MAP_FAILED;
+    struct cacheHeader *hdr = map;
+    struct cacheHeader want;
+    cacheFillHeader(&want, st, hdr->numrows, filepath);
+    size_t endsoff = sizeof(struct cacheHeader) + CACHE_ALIGN(want.pathlen);
+    size_t cpoff = endsoff + sizeof(uint64_t) * hdr->numrows;
+    if (memcmp(hdr, &want, offsetof(struct cacheHeader, hash)) ||
+        memcmp(hdr->filetype, want.filetype, sizeof(want.filetype)) ||
+        hdr->block != CACHE_BLOCK || hdr->pathlen != want.pathlen ||
+        hdr->numrows == 0 || hdr->numrows > INT_MAX ||
+        (size_t)cst.st_size != cpoff + hdr->numrows / CACHE_BLOCK + 1 ||
+        memcmp((char *)map + sizeof(struct cacheHeader), filepath, want.pathlen) ||
+        hdr->hash != editorCacheHash(fd, st->st_size))
+        goto out;
+
+    int numrows = hdr->numrows;
+    const uint64_t *ends = (const uint64_t *)((char *)map + endsoff);
+    const unsigned char *checkpoints = (const unsigned char *)map + cpoff;
+    data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) goto out;
+    madvise(data, st->st_size, MADV_SEQUENTIAL);
+
+    /* The hash only samples the file, so make sure every recorded row end
+     * is the next newline (or EOF) before trusting the index. */
+    uint64_t start = 0;
+    for (int i = 0; i < numrows; i++) {
+        char *nl = memchr(data + start, '\n', st->st_size - start);
+        uint64_t at = nl ? (uint64_t)(nl - data) : (uint64_t)st->st_size;
+        if (ends[i] != at) goto out;
+        start = at + 1;
+    }
+    if (start < (uint64_t)st->st_size) goto out;
+
+    E.buf->row = malloc(sizeof(erow) * numrows);
+    start = 0;
+    for (int i = 0; i < numrows; i++) {
+        erow *row = &E.buf->row[i];
+        size_t len = ends[i] - start;
+        while (len > 0 && data[start + len - 1] == '\r') len--;
+        editorInitRow(row, i, data + start, len);
+        editorUpdateRender(row);
+        row->stamp = ++E.stamp;
+        row->flags |= ROW_HL_STALE;
+        if ((i + 1) % CACHE_BLOCK == 0)
+            row->hl_open_comment = checkpoints[(i + 1) / CACHE_BLOCK];
+        else if (E.buf->syntax)
+            row->hl_open_comment = HL_STATE_UNKNOWN;
+        start = ends[i] + 1;
+    }
+    E.buf->numrows = numrows;
+    E.buf->stale = numrows;
+    E.buf->hlnext = 0;
+    loaded = 1;
+
+out:
+    if (data != MAP_FAILED) munmap(data, st->st_size);
+    munmap(map, cst.st_size);
+    free(filepath);
+    return loaded;
+}
+
+void editorHighlightRow(struct editorBuffer *buf, int r) {
+    struct editorBuffer *cur = E.buf;
+    E.buf = buf;
+    editorUpdateSyntax(&buf->row[r]);
+    E.buf = cur;
+}
+
+/* Highlight stale rows in file order until none are left or the deadline
+ * passes; a deadline of 0 means no limit. */
+int editorHighlightPending(struct editorBuffer *buf, long long deadline) {
+    int done = 0;
+    while (buf->stale > 0) {
+        int r = buf->hlnext;
+        while (r < buf->numrows && !(buf->row[r].flags & ROW_HL_STALE)) r++;
+        if (r == buf->numrows) {
+            if (buf->hlnext == 0) break;
+            buf->hlnext = 0;
+            continue;
+        }
+        buf->hlnext = r;
+        editorHighlightRow(buf, r);
+        done++;
+        if (deadline && editorNowUs() > deadline) break;
+    }
+    return done;
+}
+
+int editorHighlightIdle() {
+    long long deadline = editorNowUs() + CACHE_IDLE_US;
+    int done = 0;
+    for (int i = 0; i < E.numbuffers && editorNowUs() < deadline; i++)
+        if (E.buffers[i]->cached) done += editorHighlightPending(E.buffers[i], deadline);
+    return done;
+}
+
+/*** File I/O ***/
+
+char *editorRowsToString(int *buflen) {
+    int totallen = 0;
+    int j;
+    for (j = 0; j < E.buf->numrows; j++)
+        totallen += E.buf->row[j].size + 1;
+    *buflen = totallen;
+
+    char *buf = malloc(totallen);
+    char *p = buf;
+    for (j = 0; j < E.buf->numrows; j++) {
+        memcpy(p, E.buf->row[j].data, E.buf->row[j].size);
+        p += E.buf->row[j].size;
+        *p = '\n';
+        p++;
+    }
+    return buf;
+}
+
+void editorOpen(char *filename) {
+    free(E.buf->filename);
+    E.buf->filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) die("fopen");
+
+    struct stat st;
+    int cache = E.buf->numrows == 0 && fstat(fileno(fp), &st) == 0 &&
+                S_ISREG(st.st_mode) && st.st_size >= CACHE_MIN_BYTES;
+    int loaded = cache && editorCacheLoad(filename, fileno(fp), &st);
+    if (loaded) cache = 0;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    uint64_t *ends = NULL;
+    size_t endscap = 0;
+    uint64_t offset = 0;
+    E.buf->undo.suspended++;
+    while (!loaded && (linelen = getline(&line, &linecap, fp)) != -1) {
+        if (cache) {
+            if ((size_t)E.buf->numrows == endscap) {
+                endscap = endscap ? endscap * 2 : 1024;
+                ends = realloc(ends, sizeof(uint64_t) * endscap);
+            }
+            offset += linelen;
+            ends[E.buf->numrows] = line[linelen - 1] == '\n' ? offset - 1 : offset;
+        }
+        while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                               line[linelen - 1] == '\r'))
+            linelen--;
+        editorInsertRow(E.buf->numrows, line, linelen);
+    }
+    E.buf->undo.suspended--;
+    free(line);
+
+    struct stat after;
+    if (cache && fstat(fileno(fp), &after) == 0 && after.st_size == st.st_size &&
+        after.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+        after.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+        editorCacheStore(filename, fileno(fp), &st, ends);
+    else
+        free(ends);
+    fclose(fp);
+    editorUndoReset();
+    E.buf->dirty = 0;
+    editorJournalOpen();
+    editorWatchFile();
+}
+
+void editorSave() {
+    if (E.buf->filename == NULL) {
+        E.buf->filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+        if (E.buf->filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+    editorJournalFlush();
+
+    int len;
+    char *buffer = editorRowsToString(&len);
+
+    int fd = open(E.buf->filename, O_RDWR | O_CREAT, 0644);
+    if (fd != -1) {
+        if (ftruncate(fd, len) != -1) {
+            if (write(fd, buffer, len) == len) {
+                close(fd);
+                free(buffer);
+                E.buf->dirty = 0;
+                if (editorJournalReset() == -1) {
+                    editorJournalClose();
+                    editorJournalOpen();
+                }
+                editorWatchFile();
+                editorSetStatusMessage("%d bytes written to disk", len);
+                return;
+            }
+        }
+        close(fd);
+    }
+    free(buffer);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/*** Buffers ***/
+
+struct editorBuffer *editorNewBuffer() {
+    struct editorBuffer *buf = calloc(1, sizeof(struct editorBuffer));
+    buf->undo.limit = E.undolimit;
+    buf->undo.group = 1;
+    buf->undo.sealed = 1;
+    buf->journal.fd = -1;
+    buf->watch.wd = -1;
+    buf->stream = -1;
+    buf->cached = 1;
+
+    E.buffers = realloc(E.buffers, sizeof(struct editorBuffer *) * (E.numbuffers + 1));
+    E.buffers[E.numbuffers++] = buf;
+    return buf;
+}
+
+int editorBufferIndex(struct editorBuffer *buf) {
+    for (int i = 0; i < E.numbuffers; i++)
+        if (E.buffers[i] == buf) return i;
+    return -1;
+}
+
+int editorAnyDirty() {
+    for (int i = 0; i < E.numbuffers; i++)
+        if (E.buffers[i]->dirty) return 1;
+    return 0;
+}
+
+void editorBufferDropCaches(struct editorBuffer *buf) {
+    slabRelease(&buf->cache);
+    for (int i = 0; i < buf->numrows; i++) {
+        erow *row = &buf->row[i];
+        if (!(row->flags & ROW_RENDER_SHARED)) {
+            row->render = NULL;
+            row->rsize = 0;
+        }
+        row->hl = NULL;
+        row->hlcount = 0;
+    }
+    buf->cached = 0;
+}
+
+void editorTrimCaches() {
+    while (1) {
+        size_t total = 0;
+        struct editorBuffer *lru = NULL;
+        for (int i = 0; i < E.numbuffers; i++) {
+            struct editorBuffer *buf = E.buffers[i];
+            if (!buf->cached || editorBufferShown(buf)) continue;
+            total += buf->cache.reserved;
+            if (lru == NULL || buf->lastused < lru->lastused) lru = buf;
+        }
+        if (lru == NULL || total <= BUFFER_CACHE_BUDGET) return;
+        editorBufferDropCaches(lru);
+    }
+}
+
+void editorSwitchBuffer(struct editorBuffer *buf) {
+    struct editorView *view = E.view;
+    if (view->buf) {
+        editorJournalFlushBuffer(view->buf);
+        view->buf->cx = view->cx;
+        view->buf->cy = view->cy;
+        view->buf->rowoffset = view->rowoffset;
+        view->buf->coloffset = view->coloffset;
+    }
+
+    view->buf = E.buf = buf;
+    view->cx = buf->cx;
+    view->cy = buf->cy;
+    view->rowoffset = buf->rowoffset;
+    view->coloffset = buf->coloffset;
+    editorClampCursor(buf, &view->cy, &view->cx);
+    view->subrow = 0;
+    editorWrapReset(view);
+    for (int o = 0; o < OVERLAY_SLOTS; o++) view->overlay[o].row = -1;
+    view->redraw = 1;
+    buf->lastused = editorNowMs();
+
+    if (!buf->cached) {
+        for (int i = 0; i < buf->numrows; i++) editorUpdateRender(&buf->row[i]);
+        for (int i = 0; i < buf->numrows; i++)
+            if (!(buf->row[i].flags & ROW_HL_STALE)) editorUpdateSyntax(&buf->row[i]);
+        buf->cached = 1;
+    }
+    editorTrimCaches();
+}
+
+void editorFreeBuffer() {
+    struct editorBuffer *buf = E.buf;
+    int i = editorBufferIndex(buf);
+
+    editorFreeRows();
+    editorUndoReset();
+    editorWatchRemove(buf);
+    if (buf->stream != -1) close(buf->stream);
+    free(buf->journal.buf);
+    free(buf->journal.path);
+    free(buf->filename);
+    free(buf);
+
+    memmove(&E.buffers[i], &E.buffers[i + 1],
+            sizeof(struct editorBuffer *) * (E.numbuffers - i - 1));
+    E.numbuffers--;
+    E.buf = E.view->buf = NULL;
+}
+
+void editorCloseBuffer() {
+    int i = editorBufferIndex(E.buf);
+    for (int v = 0; v < E.numviews; v++)
+        if (E.views[v] != E.view && E.views[v]->buf == E.buf) E.views[v]->buf = NULL;
+    editorJournalClose();
+    editorFreeBuffer();
+
+    if (E.numbuffers == 0) editorNewBuffer();
+    if (i >= E.numbuffers) i = E.numbuffers - 1;
+    for (int v = 0; v < E.numviews; v++) {
+        struct editorView *view = E.views[v];
+        if (view == E.view || view->buf) continue;
+        for (int o = 0; o < OVERLAY_SLOTS; o++) view->overlay[o].row = -1;
+        view->buf = E.buffers[i];
+        view->cx = view->cy = view->rowoffset = view->coloffset = 0;
+        view->subrow = 0;
+        editorWrapReset(view);
+        view->redraw = 1;
+    }
+    editorSwitchBuffer(E.buffers[i]);
+}
+
+void editorNextBuffer() {
+    if (E.numbuffers < 2) {
+        editorSetStatusMessage("No other buffers");
+        return;
+    }
+    int i = (editorBufferIndex(E.buf) + 1) % E.numbuffers;
+    editorSwitchBuffer(E.buffers[i]);
+    editorSetStatusMessage("Buffer %d/%d: %s", i + 1, E.numbuffers,
+                           E.buf->filename ? E.buf->filename : "[No Name]");
+}
+
+void editorOpenPrompt() {
+    char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL, 0);
+    if (filename == NULL) return;
+
+    for (int i = 0; i < E.numbuffers; i++) {
+        if (E.buffers[i]->filename && !strcmp(E.buffers[i]->filename, filename)) {
+            editorSwitchBuffer(E.buffers[i]);
+            free(filename);
+            return;
+        }
+    }
+
+    if (access(filename, R_OK) == -1) {
+        editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+        free(filename);
+        return;
+    }
+
+    if (E.buf->filename || E.buf->numrows || E.buf->dirty)
+        editorSwitchBuffer(editorNewBuffer());
+    editorOpen(filename);
+    free(filename);
+}
+
+/*** Views ***/
+
+struct editorView *editorNewView(struct editorBuffer *buf) {
+    struct editorView *view = calloc(1, sizeof(struct editorView));
+    view->buf = buf;
+    for (int o = 0; o < OVERLAY_SLOTS; o++) view->overlay[o].row = -1;
+    view->redraw = 1;
+
+    E.views = realloc(E.views, sizeof(struct editorView *) * (E.numviews + 1));
+    E.views[E.numviews++] = view;
+    return view;
+}
+
+void editorViewInvalidateRow(struct editorView *view, int row) {
+    if (row < 0 || view->lines == NULL) return;
+    if (view->wrap) {
+        for (int y = 0; y < view->rows; y++)
+            if (view->lines[y].row == row) view->lines[y].row = INT_MIN;
+        return;
+    }
+    int y = row - view->rowoffset;
+    if (y >= 0 && y < view->rows) view->lines[y].row = INT_MIN;
+}
+
+int editorBufferShown(struct editorBuffer *buf) {
+    for (int i = 0; i < E.numviews; i++)
+        if (E.views[i]->buf == buf) return 1;
+    return 0;
+}
+
+void editorLayoutApply(struct editorLayout *node, int top, int left, int rows, int cols) {
+    node->top = top;
+    node->left = left;
+    node->rows = rows;
+    node->cols = cols;
+
+    if (node->view) {
+        struct editorView *view = node->view;
+        view->top = top;
+        view->left = left;
+        view->rows = E.numviews > 1 ? rows - 1 : rows;
+        view->cols = cols;
+        view->lines = realloc(view->lines, sizeof(struct viewLine) * view->rows);
+        view->redraw = 1;
+    } else if (node->vertical) {
+        int w = (cols - 1) / 2;
+        editorLayoutApply(node->child[0], top, left, rows, w);
+        editorLayoutApply(node->child[1], top, left + w + 1, rows, cols - w - 1);
+    } else {
+        int h = rows / 2;
+        editorLayoutApply(node->child[0], top, left, h, cols);
+        editorLayoutApply(node->child[1], top + h, left, rows - h, cols);
+    }
+}
+
+void editorLayoutUpdate() {
+    editorLayoutApply(E.layout, 0, 0, E.screenrows, E.screencols);
+    E.redraw = 1;
+}
+
+void editorSetActiveView(struct editorView *view) {
+    if (E.buf && E.buf != view->buf) editorJournalFlushBuffer(E.buf);
+    E.view = view;
+    E.buf = view->buf;
+    E.buf->lastused = editorNowMs();
+    editorClampCursor(E.buf, &view->cy, &view->cx);
+}
+
+void editorSplitView(int vertical) {
+    struct editorView *old = E.view;
+    if ((vertical && old->cols < 21) || (!vertical && old->rows < 5)) {
+        editorSetStatusMessage("Not enough room to split");
+        return;
+    }
+
+    struct editorView *view = editorNewView(old->buf);
+    view->cx = old->cx;
+    view->cy = old->cy;
+    view->rowoffset = old->rowoffset;
+    view->coloffset = old->coloffset;
+    view->wrap = old->wrap;
+    view->subrow = old->subrow;
+
+    struct editorLayout *node = old->node;
+    struct editorLayout *inner = calloc(1, sizeof(struct editorLayout));
+    struct editorLayout *leaf = calloc(1, sizeof(struct editorLayout));
+    inner->vertical = vertical;
+    inner->parent = node->parent;
+    if (node->parent) {
+        node->parent->child[node->parent->child[1] == node] = inner;
+    } else {
+        E.layout = inner;
+    }
+    inner->child[0] = node;
+    inner->child[1] = leaf;
+    node->parent = leaf->parent = inner;
+    leaf->view = view;
+    view->node = leaf;
+
+    editorLayoutUpdate();
+    editorSetActiveView(view);
+}
+
+void editorCloseView() {
+    if (E.numviews < 2) {
+        editorSetStatusMessage("Can't close the last window");
+        return;
+    }
+
+    struct editorView *view = E.view;
+    struct editorLayout *node = view->node;
+    struct editorLayout *parent = node->parent;
+    struct editorLayout *sibling = parent->child[parent->child[0] == node];
+
+    sibling->parent = parent->parent;
+    if (parent->parent) {
+        parent->parent->child[parent->parent->child[1] == parent] = sibling;
+    } else {
+        E.layout = sibling;
+    }
+    free(parent);
+    free(node);
+
+    int i;
+    for (i = 0; E.views[i] != view; i++);
+    memmove(&E.views[i], &E.views[i + 1],
+            sizeof(struct editorView *) * (E.numviews - i - 1));
+    E.numviews--;
+    editorWrapReset(view);
+    free(view->lines);
+    free(view);
+
+    while (sibling->view == NULL) sibling = sibling->child[0];
+    editorSetActiveView(sibling->view);
+    editorLayoutUpdate();
+    editorTrimCaches();
+}
+
+void editorNextView() {
+    int i;
+    for (i = 0; E.views[i] != E.view; i++);
+    editorSetActiveView(E.views[(i + 1) % E.numviews]);
+}
+
+void editorWindowCommand() {
+    int c = editorReadKey();
+    switch (c) {
+        case 's':
+        case CTRL_KEY('s'):
+            editorSplitView(0);
+            break;
+        case 'v':
+        case CTRL_KEY('v'):
+            editorSplitView(1);
+            break;
+        case 'w':
+        case CTRL_KEY('w'):
+            editorNextView();
+            break;
+        case 'c':
+        case 'q':
+            editorCloseView();
+            break;
+    }
+}
+
+/** Search ***/
+void editorSetOverlay(int slot, int row, int start, int len, unsigned char hl) {
+    struct hlOverlay *o = &E.view->overlay[slot];
+    if (o->row == row && o->start == start && o->len == len && o->hl == hl) return;
+    editorViewInvalidateRow(E.view, E.view->overlay[slot].row);
+    editorViewInvalidateRow(E.view, row);
+    E.view->overlay[slot].row = row;
+    E.view->overlay[slot].start = start;
+    E.view->overlay[slot].len = len;
+    E.view->overlay[slot].hl = hl;
+}
+
+void editorSearchCallback(char *query, int key) {
+    static int last_match = -1;
+    static int direction = 1;
+
+    editorSetOverlay(OVERLAY_SEARCH, -1, 0, 0, HL_NORMAL);
+
+    if (key == '\r' || key == '\x1b') {
+        last_match = -1;
+        direction = 1;
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+    } else {
+        last_match = -1;
+        direction = -1;
+    }
+
+    if (last_match == -1) direction = 1;
+    int current = last_match;
+
+    int i;
+    for (i = 0; i < E.buf->numrows; i++) {
+        current += direction;
+        if (current == -1) current = E.buf->numrows - 1;
+        else if (current == E.buf->numrows) current = 0;
+
+        erow *row = &E.buf->row[current];
+        char *match = strstr(row->render, query);
+        if (match) {
+            last_match = current;
+            E.view->cy = current;
+            E.view->cx = editorRowRxToCx(row, match - row->render);
+            E.view->rowoffset = E.buf->numrows;
+            editorSetOverlay(OVERLAY_SEARCH, current, match - row->render,
+                             strlen(query), HL_MATCH);
+            break;
+        }
+    }
+}
+
+void editorSearch() {
+    int scx = E.view->cx;
+    int scy = E.view->cy;
+    int scoloffset = E.view->coloffset;
+    int srowoffset = E.view->rowoffset;
+
+
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorSearchCallback, 0);
+    if (query) {
+        free(query);
+    } else {
+        E.view->cx = scx;
+        E.view->cy = scy;
+        E.view->coloffset = scoloffset;
+        E.view->rowoffset = srowoffset;
+    }
+
+
+}
+/*** Soft Wrap ***/
+
+void editorWrapReset(struct editorView *view) {
+    struct wrapCache *wc = &view->wraps;
+    for (int i = 0; i < wc->numrows; i++) free(wc->rows[i].breaks);
+    free(wc->rows);
+    free(wc->tree);
+    memset(wc, 0, sizeof(*wc));
+}
+
+/* Break row into lines of at most width columns, preferring to break
+ * after a space. A row exactly width columns long gets an empty last
+ * line so the cursor has somewhere to sit at its end. */
+void wrapRowBreaks(struct wrapRow *wr, erow *row, int width) {
+    static int *breaks;
+    static int cap;
+    int n = 0, start = 0;
+
+    if (width < 1) width = 1;
+    while (row->rsize - start >= width) {
+        int brk = start + width;
+        int k = brk;
+        while (k > start && row->render[k - 1] != ' ') k--;
+        if (k > start) brk = k;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            breaks = realloc(breaks, sizeof(int) * cap);
+        }
+        breaks[n++] = brk;
+        start = brk;
+    }
+
+    free(wr->breaks);
+    wr->breaks = NULL;
+    if (n) {
+        wr->breaks = malloc(sizeof(int) * n);
+        memcpy(wr->breaks, breaks, sizeof(int) * n);
+    }
+    wr->count = n + 1;
+    wr->stamp = row->stamp;
+}
+
+void wrapTreeAdd(struct wrapCache *wc, int i, int delta) {
+    for (i++; i <= wc->numrows; i += i & -i) wc->tree[i] += delta;
+}
+
+void wrapTreeBuild(struct wrapCache *wc) {
+    wc->tree = realloc(wc->tree, sizeof(int) * (wc->numrows + 1));
+    wc->tree[0] = 0;
+    for (int i = 1; i <= wc->numrows; i++) wc->tree[i] = wc->rows[i - 1].count;
+    for (int i = 1; i <= wc->numrows; i++) {
+        int j = i + (i & -i);
+        if (j <= wc->numrows) wc->tree[j] += wc->tree[i];
+    }
+    wc->valid = 1;
+}
+
+/* Visual lines above row r. */
+int wrapPrefix(struct wrapCache *wc, int r) {
+    int sum = 0;
+    for (; r > 0; r -= r & -r) sum += wc->tree[r];
+    return sum;
+}
+
+/* Row holding visual line v, with *sub set to the line within that row.
+ * Lines past the end map to numrows. */
+int wrapFind(struct wrapCache *wc, int v, int *sub) {
+    int pos = 0, step = 1;
+    while (step * 2 <= wc->numrows) step *= 2;
+    for (; step; step /= 2) {
+        if (pos + step <= wc->numrows && wc->tree[pos + step] <= v) {
+            pos += step;
+            v -= wc->tree[pos];
+        }
+    }
+    *sub = pos < wc->numrows ? v : 0;
+    return pos;
+}
+
+/* Bring the view's layout up to date with its buffer and width. Only a
+ * width change or a new buffer recomputes every row; edits keep it
+ * current through editorWrapRowChanged and editorWrapShift. */
+void editorWrapEnsure(struct editorView *view) {
+    struct wrapCache *wc = &view->wraps;
+    struct editorBuffer *buf = view->buf;
+
+    if (wc->width != view->cols || wc->buf != buf || wc->numrows != buf->numrows) {
+        editorWrapReset(view);
+        wc->width = view->cols;
+        wc->buf = buf;
+        wc->numrows = buf->numrows;
+        wc->rows = calloc(buf->numrows + 1, sizeof(struct wrapRow));
+        for (int i = 0; i < buf->numrows; i++)
+            wrapRowBreaks(&wc->rows[i], &buf->row[i], wc->width);
+    }
+    if (!wc->valid) wrapTreeBuild(wc);
+}
+
+struct wrapRow *editorWrapRow(struct editorView *view, int r) {
+    struct wrapRow *wr = &view->wraps.rows[r];
+    erow *row = &view->buf->row[r];
+    if (wr->stamp != row->stamp) {
+        int count = wr->count;
+        wrapRowBreaks(wr, row, view->wraps.width);
+        if (view->wraps.valid) wrapTreeAdd(&view->wraps, r, wr->count - count);
+    }
+    return wr;
+}
+
+void editorWrapRowChanged(erow *row) {
+    for (int i = 0; i < E.numviews; i++) {
+        struct editorView *view = E.views[i];
+        if (!view->wrap || view->wraps.buf != E.buf || row->idx >= view->wraps.numrows)
+            continue;
+        editorWrapRow(view, row->idx);
+    }
+}
+
+/* Mirror a splice of the row array in every wrapped view of E.buf. The
+ * new entries are filled in as their rows are highlighted. */
+void editorWrapShift(int at, int del, int count) {
+    for (int i = 0; i < E.numviews; i++) {
+        struct wrapCache *wc = &E.views[i]->wraps;
+        if (!E.views[i]->wrap || wc->buf != E.buf) continue;
+
+        for (int j = 0; j < del; j++) free(wc->rows[at + j].breaks);
+        int numrows = wc->numrows - del + count;
+        if (count > del) wc->rows = realloc(wc->rows, sizeof(struct wrapRow) * (numrows + 1));
+        memmove(&wc->rows[at + count], &wc->rows[at + del],
+                sizeof(struct wrapRow) * (wc->numrows - at - del));
+        memset(&wc->rows[at], 0, sizeof(struct wrapRow) * count);
+        for (int j = 0; j < count; j++) wc->rows[at + j].count = 1;
+        wc->numrows = numrows;
+        wc->valid = 0;
+    }
+}
+
+int wrapLineStart(struct wrapRow *wr, int sub) {
+    return sub ? wr->breaks[sub - 1] : 0;
+}
+
+int wrapLineEnd(struct wrapRow *wr, erow *row, int sub) {
+    return sub < wr->count - 1 ? wr->breaks[sub] : row->rsize;
+}
+
+int wrapSubLine(struct wrapRow *wr, int rx) {
+    int lo = 0, hi = wr->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (wr->breaks[mid - 1] <= rx) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Visual line of the cursor, also leaving its column within that line
+ * in *col. */
+int editorWrapCursor(struct editorView *view, int *col) {
+    editorWrapEnsure(view);
+    *col = 0;
+    if (view->cy >= view->buf->numrows) return wrapPrefix(&view->wraps, view->buf->numrows);
+    struct wrapRow *wr = editorWrapRow(view, view->cy);
+    int sub = wrapSubLine(wr, view->rx);
+    *col = view->rx - wrapLineStart(wr, sub);
+    return wrapPrefix(&view->wraps, view->cy) + sub;
+}
+
+/* Place the cursor on visual line v at column col, or as close as the
+ * line allows. */
+void editorWrapMoveTo(struct editorView *view, int v, int col) {
+    int total = wrapPrefix(&view->wraps, view->buf->numrows);
+    if (v < 0) v = 0;
+    if (v > total) v = total;
+    int sub;
+    view->cy = wrapFind(&view->wraps, v, &sub);
+    view->cx = 0;
+    if (view->cy >= view->buf->numrows) return;
+
+    erow *row = &view->buf->row[view->cy];
+    struct wrapRow *wr = editorWrapRow(view, view->cy);
+    int start = wrapLineStart(wr, sub);
+    int end = wrapLineEnd(wr, row, sub);
+    if (sub < wr->count - 1) end--;
+    int rx = start + col > end ? end : start + col;
+    view->cx = editorRowRxToCx(row, rx);
+}
+
+void editorWrapScroll(struct editorView *view) {
+    int col;
+    int cur = editorWrapCursor(view, &col);
+    int top = wrapPrefix(&view->wraps, view->rowoffset);
+    if (view->rowoffset < view->buf->numrows) {
+        struct wrapRow *wr = editorWrapRow(view, view->rowoffset);
+        if (view->subrow >= wr->count) view->subrow = wr->count - 1;
+        top += view->subrow;
+    }
+
+    if (cur < top) top = cur;
+    if (cur >= top + view->rows) top = cur - view->rows + 1;
+    view->rowoffset = wrapFind(&view->wraps, top, &view->subrow);
+    view->coloffset = 0;
+    view->sy = cur - top;
+    view->sx = col;
+}
+
+void editorWrapVertical(int dir) {
+    int col;
+    int cur = editorWrapCursor(E.view, &col);
+    editorWrapMoveTo(E.view, cur + dir, col);
+}
+
+void editorWrapPage(int dir) {
+    editorWrapEnsure(E.view);
+    int top = wrapPrefix(&E.view->wraps, E.view->rowoffset) + E.view->subrow;
+    editorWrapMoveTo(E.view, dir < 0 ? top - E.view->rows : top + 2 * E.view->rows - 1, 0);
+}
+
+void editorToggleWrap() {
+    struct editorView *view = E.view;
+    view->wrap = !view->wrap;
+    view->subrow = 0;
+    view->coloffset = 0;
+    view->redraw = 1;
+    if (!view->wrap) editorWrapReset(view);
+    editorSetStatusMessage("Soft wrap %s", view->wrap ? "on" : "off");
+}
+
+/*** Replace ***/
+
+struct replaceEdit {
+    int row;
+    int len;
+    size_t offset;
+};
+
+struct replaceJob {
+    struct editorBuffer *buf;
+    const char *query, *with;
+    int qlen, wlen;
+    int lo, hi;
+    char *text;
+    size_t textlen, textcap;
+    struct replaceEdit *edits;
+    int numedits, capedits;
+    long long matches;
+};
+
+void replaceAppend(struct replaceJob *job, const char *s, size_t len) {
+    if (len == 0) return;
+    if (job->textlen + len > job->textcap) {
+        size_t cap = job->textcap ? job->textcap * 2 : 64 * 1024;
+        while (cap < job->textlen + len) cap *= 2;
+        job->text = realloc(job->text, cap);
+        job->textcap = cap;
+    }
+    memcpy(&job->text[job->textlen], s, len);
+    job->textlen += len;
+}
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buffer, len) == len) {
-                close(fd);
-                free(buffer);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
+/* Rewrite every matching row in [lo, hi) into the job's private text
+ * buffer. Runs on worker threads, so it only reads the buffer. */
+void *replaceWorker(void *arg) {
+    struct replaceJob *job = arg;
+    for (int i = job->lo; i < job->hi; i++) {
+        erow *row = &job->buf->row[i];
+        const char *p = row->data, *end = row->data + row->size;
+        const char *m = memmem(p, end - p, job->query, job->qlen);
+        if (m == NULL) continue;
+
+        if (job->numedits == job->capedits) {
+            job->capedits = job->capedits ? job->capedits * 2 : 256;
+            job->edits = realloc(job->edits, sizeof(struct replaceEdit) * job->capedits);
+        }
+        struct replaceEdit *ed = &job->edits[job->numedits++];
+        ed->row = i;
+        ed->offset = job->textlen;
+        while (m) {
+            replaceAppend(job, p, m - p);
+            replaceAppend(job, job->with, job->wlen);
+            job->matches++;
+            p = m + job->qlen;
+            m = memmem(p, end - p, job->query, job->qlen);
+        }
+        replaceAppend(job, p, end - p);
+        ed->len = job->textlen - ed->offset;
+    }
+    return NULL;
+}
+
+/* Log each replacement in row as a delete and insert at its column in
+ * the partly rewritten row, so undo can replay them back to front. */
+void replaceRecord(erow *row, const char *query, int qlen, const char *with, int wlen) {
+    const char *end = row->data + row->size;
+    const char *m = memmem(row->data, row->size, query, qlen);
+    int shift = 0;
+    while (m) {
+        int col = m - row->data + shift;
+        editorUndoRecord(UNDO_DELETE, row->idx, col, query, qlen);
+        editorJournalRecord(UNDO_DELETE, row->idx, col, query, qlen);
+        if (wlen) {
+            editorUndoRecord(UNDO_INSERT, row->idx, col, with, wlen);
+            editorJournalRecord(UNDO_INSERT, row->idx, col, with, wlen);
+        }
+        shift += wlen - qlen;
+        m = memmem(m + qlen, end - m - qlen, query, qlen);
+    }
+}
+
+void editorReplaceAll(const char *query, const char *with) {
+    struct replaceJob jobs[REPLACE_MAX_THREADS];
+    pthread_t threads[REPLACE_MAX_THREADS];
+    int started[REPLACE_MAX_THREADS] = {0};
+    int qlen = strlen(query), wlen = strlen(with);
+
+    int nthreads = 1;
+    if (E.buf->numrows >= REPLACE_PARALLEL_ROWS) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = n < 1 ? 1 : n > REPLACE_MAX_THREADS ? REPLACE_MAX_THREADS : n;
+    }
+
+    memset(jobs, 0, sizeof(jobs));
+    for (int t = 0; t < nthreads; t++) {
+        jobs[t].buf = E.buf;
+        jobs[t].query = query;
+        jobs[t].qlen = qlen;
+        jobs[t].with = with;
+        jobs[t].wlen = wlen;
+        jobs[t].lo = (long long)E.buf->numrows * t / nthreads;
+        jobs[t].hi = (long long)E.buf->numrows * (t + 1) / nthreads;
+        if (t > 0) started[t] = pthread_create(&threads[t], NULL, replaceWorker, &jobs[t]) == 0;
+    }
+    replaceWorker(&jobs[0]);
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+        else replaceWorker(&jobs[t]);
+    }
+
+    editorUndoSeal();
+    long long matches = 0;
+    int rows = 0;
+    for (int t = 0; t < nthreads; t++) {
+        for (int i = 0; i < jobs[t].numedits; i++) {
+            struct replaceEdit *ed = &jobs[t].edits[i];
+            erow *row = &E.buf->row[ed->row];
+            replaceRecord(row, query, qlen, with, wlen);
+            editorIndexWords(row->data, 0, row->size, -1);
+            slabFree(&E.buf->pool, row->data, row->size + 1);
+            row->data = slabAlloc(&E.buf->pool, ed->len + 1);
+            memcpy(row->data, &jobs[t].text[ed->offset], ed->len);
+            row->data[ed->len] = '\0';
+            row->size = ed->len;
+            editorIndexWords(row->data, 0, row->size, 1);
+        }
+        matches += jobs[t].matches;
+        rows += jobs[t].numedits;
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        for (int i = 0; i < jobs[t].numedits; i++)
+            editorUpdateRow(&E.buf->row[jobs[t].edits[i].row]);
+        free(jobs[t].text);
+        free(jobs[t].edits);
+    }
+
+    if (rows) E.buf->dirty++;
+    if (E.view->cy < E.buf->numrows && E.view->cx > E.buf->row[E.view->cy].size)
+        E.view->cx = E.buf->row[E.view->cy].size;
+    editorSetStatusMessage("Replaced %lld occurrences on %d lines", matches, rows);
+}
+
+void editorReplace() {
+    char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL, 0);
+    if (query == NULL) return;
+    char *with = editorPrompt("Replace with: %s (ESC to cancel)", NULL,
+                              PROMPT_ALLOW_EMPTY);
+    if (with) editorReplaceAll(query, with);
+    free(query);
+    free(with);
+}
+
+/*** Filter ***/
+
+struct filterState {
+    int from;
+    int rows;
+    int written;
+    size_t offset;
+    int out;
+    int del;
+    size_t delbytes;
+    int spliced;
+    char *pending;
+    size_t len, cap;
+};
+
+/* Write as much of the remaining range as the pipe takes, one writev of
+ * row data and newlines at a time. Returns 1 once the range is done or
+ * the reader has gone away. */
+int filterWrite(struct filterState *fs, int fd) {
+    static char newline = '\n';
+    struct iovec iov[FILTER_IOV];
+
+    while (fs->written < fs->rows) {
+        int n = 0;
+        size_t offset = fs->offset;
+        for (int r = fs->written; r < fs->rows && n + 2 <= FILTER_IOV; r++) {
+            erow *row = &E.buf->row[fs->from + fs->out + fs->del + r - fs->written];
+            if (offset < (size_t)row->size) {
+                iov[n].iov_base = row->data + offset;
+                iov[n++].iov_len = row->size - offset;
             }
+            iov[n].iov_base = &newline;
+            iov[n++].iov_len = 1;
+            offset = 0;
+        }
+
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1) return errno != EAGAIN && errno != EINTR;
+
+        while (w > 0) {
+            erow *row = &E.buf->row[fs->from + fs->out + fs->del];
+            size_t left = row->size + 1 - fs->offset;
+            if ((size_t)w < left) {
+                fs->offset += w;
+                break;
+            }
+            w -= left;
+            fs->offset = 0;
+            fs->written++;
+            fs->del++;
+            fs->delbytes += row->size + 1;
         }
-        close(fd);
     }
-    free(buffer);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return 1;
 }
 
-/** Search ***/
-void editorSearchCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
+/* Replace the rows already sent to the command with the complete lines
+ * of output received so far, or everything when done is set. */
+void filterFlush(struct filterState *fs, int done) {
+    size_t upto = fs->len;
+    if (!done) {
+        char *nl = memrchr(fs->pending, '\n', fs->len);
+        upto = nl ? (size_t)(nl - fs->pending) + 1 : 0;
+    }
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+    int count;
+    struct rowText *text = editorSplitText(fs->pending, upto, &count);
+    editorSpliceRows(fs->from + fs->out, fs->del, text, count);
+    free(text);
+
+    fs->out += count;
+    fs->spliced = 1;
+    fs->del = 0;
+    fs->delbytes = 0;
+    memmove(fs->pending, fs->pending + upto, fs->len - upto);
+    fs->len -= upto;
+}
+
+/* Splicing moves every row below the range, so hold output back until
+ * it is large compared to that tail to keep the total work linear. */
+int filterShouldFlush(struct filterState *fs) {
+    size_t tail = (size_t)(E.buf->numrows - fs->from - fs->out) * sizeof(erow) / 4;
+    size_t batch = tail > FILTER_BATCH_BYTES ? tail : FILTER_BATCH_BYTES;
+    return fs->len + fs->delbytes >= batch;
+}
+
+/* Drain pending keys while a filter runs; ESC or Ctrl-C cancels it. */
+int filterCancelKey() {
+    char keys[64];
+    ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+    for (ssize_t i = 0; i < n; i++)
+        if (keys[i] == CTRL_KEY('c') || (keys[i] == '\x1b' && i == n - 1)) return 1;
+    return 0;
+}
 
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+/* Pipe rows [from, from + rows) through cmd and put its output in their
+ * place. Rows are written straight from the row array while output is
+ * read back, and both sides are spliced into the buffer in batches, so
+ * neither a copy of the input nor the whole output is held at once.
+ * Returns the number of rows produced, or -1 if the command could not be
+ * run or failed before anything was replaced. *cancelled is set when the
+ * user stopped the command from the keyboard. */
+int editorFilterRows(int from, int rows, const char *cmd, int *status, int *cancelled) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) == -1) return -1;
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
     }
 
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = -1;
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    pid_t pid;
+    char *argv[] = {"sh", "-c", (char *)cmd, NULL};
+    int err = posix_spawn(&pid, "/bin/sh", &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    close(in[0]);
+    close(out[1]);
+    if (err) {
+        close(in[1]);
+        close(out[0]);
+        errno = err;
+        return -1;
     }
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
+    void (*oldpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL) | O_NONBLOCK);
+    fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+
+    struct filterState fs = {0};
+    fs.from = from;
+    fs.rows = rows;
+    int infd = in[1];
+    if (rows == 0) {
+        close(infd);
+        infd = -1;
+    }
 
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
+    int keys = isatty(STDIN_FILENO) ? STDIN_FILENO : -1;
+    *cancelled = 0;
+    while (1) {
+        struct pollfd pfd[3] = {{keys, POLLIN, 0}, {out[0], POLLIN, 0}, {infd, POLLOUT, 0}};
+        if (poll(pfd, infd == -1 ? 2 : 3, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
 
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoffset = E.numrows;
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+        if (pfd[0].revents && filterCancelKey()) {
+            kill(-pid, SIGTERM);
+            *cancelled = 1;
+            break;
+        }
+
+        if (infd != -1 && pfd[2].revents && filterWrite(&fs, infd)) {
+            close(infd);
+            infd = -1;
+        }
+
+        if (!pfd[1].revents) continue;
+        if (fs.cap - fs.len < FILTER_CHUNK_SIZE) {
+            fs.cap = fs.cap ? fs.cap * 2 : FILTER_CHUNK_SIZE * 2;
+            fs.pending = realloc(fs.pending, fs.cap);
+        }
+        ssize_t n = read(out[0], fs.pending + fs.len, fs.cap - fs.len);
+        if (n == 0) break;
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) continue;
             break;
         }
+        fs.len += n;
+        if (filterShouldFlush(&fs)) filterFlush(&fs, 0);
     }
-}
 
-void editorSearch() {
-    int scx = E.cx;
-    int scy = E.cy;
-    int scoloffset = E.coloffset;
-    int srowoffset = E.rowoffset;
+    if (infd != -1) close(infd);
+    close(out[0]);
+
+    /* A command may outlive its output or ignore SIGTERM; keep taking
+     * cancel keys while it exits and kill the group after a grace period. */
+    long long killat = *cancelled ? editorNowMs() + FILTER_KILL_MS : 0;
+    pid_t w;
+    while ((w = waitpid(pid, status, WNOHANG)) == 0 || (w == -1 && errno == EINTR)) {
+        if (killat && editorNowMs() >= killat) {
+            kill(-pid, SIGKILL);
+            waitpid(pid, status, 0);
+            break;
+        }
+        struct pollfd key = {keys, POLLIN, 0};
+        if (poll(&key, 1, 10) > 0 && !*cancelled && filterCancelKey()) {
+            kill(-pid, SIGTERM);
+            *cancelled = 1;
+            killat = editorNowMs() + FILTER_KILL_MS;
+        }
+    }
+    signal(SIGPIPE, oldpipe);
+
+    /* Take back what was already spliced when the undo log still holds
+     * it; otherwise keep the output read so far in place of the range. */
+    struct undoLog *u = &E.buf->undo;
+    if (*cancelled && fs.spliced && u->head > 0 &&
+        undoRecordBefore(u, u->head)->group == u->group) {
+        editorUndo();
+        u->top = u->head;
+        fs.spliced = 0;
+    }
+    if (*cancelled && !fs.spliced) {
+        free(fs.pending);
+        return -1;
+    }
 
+    if (!fs.spliced && fs.len == 0 && !(WIFEXITED(*status) && WEXITSTATUS(*status) == 0)) {
+        free(fs.pending);
+        return -1;
+    }
+    fs.del += fs.rows - fs.written;
+    filterFlush(&fs, 1);
+    free(fs.pending);
+    return fs.out;
+}
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorSearchCallback);
-    if (query) {
-        free(query);
-    } else {
-        E.cx = scx;
-        E.cy = scy;
-        E.coloffset = scoloffset;
-        E.rowoffset = srowoffset;
+void editorFilter() {
+    char *input = editorPrompt("Filter through: %s (prefix from,to for a line range)", NULL, 0);
+    if (input == NULL) return;
+
+    int from = 0, rows = E.buf->numrows;
+    int first, last, skip = 0;
+    char *cmd = input;
+    if (sscanf(input, "%d,%d %n", &first, &last, &skip) == 2 && skip > 0) {
+        if (first < 1 || last < first || last > E.buf->numrows) {
+            editorSetStatusMessage("Invalid line range %d,%d", first, last);
+            free(input);
+            return;
+        }
+        from = first - 1;
+        rows = last - first + 1;
+        cmd = input + skip;
     }
 
+    editorSetStatusMessage("Filtering through %s... (ESC to cancel)", cmd);
+    editorRefreshScreen();
+
+    int status = 0, cancelled;
+    int out = editorFilterRows(from, rows, cmd, &status, &cancelled);
+    if (cancelled && out == -1) {
+        editorSetStatusMessage("Filter cancelled");
+    } else if (cancelled) {
+        editorSetStatusMessage("Filter cancelled; %d lines replaced by %d lines of output",
+                               rows, out);
+    } else if (out == -1 && status) {
+        editorSetStatusMessage("Filter exited with status %d; nothing replaced",
+                               WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    } else if (out == -1) {
+        editorSetStatusMessage("Can't run filter: %s", strerror(errno));
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        editorSetStatusMessage("Filter exited with status %d; %d lines replaced by %d",
+                               WEXITSTATUS(status), rows, out);
+    } else {
+        editorSetStatusMessage("%d lines replaced by %d", rows, out);
+    }
 
+    if (out != -1) {
+        E.view->cy = from < E.buf->numrows ? from : E.buf->numrows;
+        E.view->cx = 0;
+    }
+    free(input);
 }
+
 /*** Append Buffer ***/
 struct append_buffer {
     char *buf;
@@ -710,6 +3899,7 @@ struct append_buffer {
 
 void appendBufferAppend(struct append_buffer *ab, const char *s, int len) {
     char *new = realloc(ab->buf, ab->len + len);
+    E.prof.allocs++;
 
     if (new == NULL) return;
     memcpy(&new[ab->len], s, len);
@@ -723,104 +3913,246 @@ void appendBufferFree(struct append_buffer *ab) {
 
 /*** Output ***/
 void editorScroll() {
-    E.rx = 0;
+    E.view->rx = 0;
 
-    if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    if (E.view->cy < E.buf->numrows) {
+        E.view->rx = editorRowCxToRx(&E.buf->row[E.view->cy], E.view->cx);
+    }
+    if (E.view->wrap) {
+        editorWrapScroll(E.view);
+        return;
     }
 
-    if (E.cy < E.rowoffset) {
-        E.rowoffset = E.cy;
+    if (E.view->cy < E.view->rowoffset) {
+        E.view->rowoffset = E.view->cy;
     }
-    if (E.cy >= E.rowoffset + E.screenrows) {
-        E.rowoffset = E.cy - E.screenrows + 1;
+    if (E.view->cy >= E.view->rowoffset + E.view->rows) {
+        E.view->rowoffset = E.view->cy - E.view->rows + 1;
     }
-    if (E.rx < E.coloffset) {
-        E.coloffset = E.rx;
+    if (E.view->rx < E.view->coloffset) {
+        E.view->coloffset = E.view->rx;
     }
-    if (E.rx >= E.coloffset + E.screencols) {
-        E.coloffset = E.rx - E.screencols + 1;
+    if (E.view->rx >= E.view->coloffset + E.view->cols) {
+        E.view->coloffset = E.view->rx - E.view->cols + 1;
     }
+    E.view->sy = E.view->cy - E.view->rowoffset;
+    E.view->sx = E.view->rx - E.view->coloffset;
 }
 
-void editorDrawRows(struct append_buffer *ab) {
-    int y;
-    for (y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoffset;
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows / 3) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                  "TE -- version %s", VERSION);
-                if (welcomelen > E.screencols) welcomelen = E.screencols;
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding) {
-                    appendBufferAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) appendBufferAppend(ab, " ", 1);
-                appendBufferAppend(ab, welcome, welcomelen);
-            } else {
-                appendBufferAppend(ab, "~", 1);
+void editorDrawText(struct append_buffer *ab, const char *c, int len,
+                    int color) {
+    int j = 0;
+    while (j < len) {
+        int k = j;
+        while (k < len && !iscntrl((unsigned char)c[k])) k++;
+        appendBufferAppend(ab, &c[j], k - j);
+        if (k == len) break;
+
+        char sym = (c[k] <= 26) ? '@' + c[k] : '?';
+        appendBufferAppend(ab, "\x1b[7m", 4);
+        appendBufferAppend(ab, &sym, 1);
+        appendBufferAppend(ab, "\x1b[m", 3);
+        if (color != -1) {
+            char buffer[16];
+            int clen = snprintf(buffer, sizeof(buffer), "\x1b[%dm", color);
+            appendBufferAppend(ab, buffer, clen);
+        }
+        j = k + 1;
+    }
+}
+
+void editorDrawRowSegment(struct append_buffer *ab, struct editorView *view,
+                          erow *row, int from, int to) {
+    int span = 0;
+    int spanstart = 0;
+    while (span < row->hlcount &&
+           spanstart + HL_SPAN_LEN(row->hl[span]) <= from) {
+        spanstart += HL_SPAN_LEN(row->hl[span]);
+        span++;
+    }
+
+    int current_color = -1;
+    int at = from;
+    while (at < to) {
+        int hl = HL_NORMAL;
+        int end = to;
+        if (span < row->hlcount) {
+            hl = HL_SPAN_TYPE(row->hl[span]);
+            if (spanstart + HL_SPAN_LEN(row->hl[span]) < end)
+                end = spanstart + HL_SPAN_LEN(row->hl[span]);
+        }
+
+        for (int o = 0; o < OVERLAY_SLOTS; o++) {
+            struct hlOverlay *ov = &view->overlay[o];
+            if (ov->row != row->idx) continue;
+            if (ov->start <= at && at < ov->start + ov->len) {
+                hl = ov->hl;
+                if (ov->start + ov->len < end) end = ov->start + ov->len;
+            } else if (ov->start > at && ov->start < end) {
+                end = ov->start;
             }
-        } else {
-            int len = E.row[filerow].rsize - E.coloffset;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            char *c = &E.row[filerow].render[E.coloffset];
-            unsigned char *hl = &E.row[filerow].hl[E.coloffset];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    appendBufferAppend(ab, "\x1b[7m", 4);
-                    appendBufferAppend(ab, &sym, 1);
-                    appendBufferAppend(ab, "\x1b[m", 3);
-                    if (current_color == -1) {
-                        char buffer[16];
-                        int clen = snprintf(buffer, sizeof(buffer), "\x1b[%dm", current_color);
-                        appendBufferAppend(ab, buffer, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        appendBufferAppend(ab, "\x1b[39m", 1);
-                        current_color = -1;
-                    }
-                    appendBufferAppend(ab, "\x1b[39m", 5);
-                    appendBufferAppend(ab, &c[j], 1);
-                }else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buffer[16];
-                        int clen = snprintf(buffer, sizeof(buffer), "\x1b[%dm", color);
-                        appendBufferAppend(ab, buffer, clen);
-                    }
-                    appendBufferAppend(ab, &c[j], 1);
-                }
+        }
+
+        int color = (hl == HL_NORMAL) ? -1 : editorSyntaxToColor(hl);
+        if (color != current_color) {
+            char buffer[16];
+            int clen = snprintf(buffer, sizeof(buffer), "\x1b[%dm",
+                                color == -1 ? 39 : color);
+            appendBufferAppend(ab, buffer, clen);
+            current_color = color;
+        }
+        editorDrawText(ab, &row->render[at], end - at, current_color);
+
+        at = end;
+        if (span < row->hlcount &&
+            at >= spanstart + HL_SPAN_LEN(row->hl[span])) {
+            spanstart += HL_SPAN_LEN(row->hl[span]);
+            span++;
+        }
+    }
+    appendBufferAppend(ab, "\x1b[39m", 5);
+}
+
+int editorDrawLine(struct append_buffer *ab, struct editorView *view,
+                   struct viewLine *line) {
+    struct editorBuffer *buf = view->buf;
+
+    if (line->row >= 0 && view->wrap) {
+        erow *row = &buf->row[line->row];
+        struct wrapRow *wr = editorWrapRow(view, line->row);
+        int start = wrapLineStart(wr, line->sub);
+        int end = wrapLineEnd(wr, row, line->sub);
+        editorDrawRowSegment(ab, view, row, start, end);
+        return end - start;
+    }
+    if (line->row >= 0) {
+        erow *row = &buf->row[line->row];
+        int stop = view->coloffset + view->cols;
+        if (stop > row->rsize) stop = row->rsize;
+        if (stop < view->coloffset) stop = view->coloffset;
+        editorDrawRowSegment(ab, view, row, view->coloffset, stop);
+        return stop - view->coloffset;
+    }
+
+    if (line->row == -2) {
+        char welcome[80];
+        int welcomelen = snprintf(welcome, sizeof(welcome),
+          "TE -- version %s", VERSION);
+        if (welcomelen > view->cols) welcomelen = view->cols;
+        int padding = (view->cols - welcomelen) / 2;
+        int width = padding + welcomelen;
+        if (padding) {
+            appendBufferAppend(ab, "~", 1);
+            padding--;
+        }
+        while (padding--) appendBufferAppend(ab, " ", 1);
+        appendBufferAppend(ab, welcome, welcomelen);
+        return width;
+    }
+
+    appendBufferAppend(ab, "~", 1);
+    return 1;
+}
+
+void editorDrawViewStatus(struct append_buffer *ab, struct editorView *view) {
+    char status[160];
+    int len = snprintf(status, sizeof(status), " %.40s%s %d/%d",
+      view->buf->filename ? view->buf->filename : "[No Name]",
+      view->buf->dirty ? " [+]" : "", view->cy + 1, view->buf->numrows);
+    if (len > view->cols) len = view->cols;
+
+    char buffer[32];
+    int clen = snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH%s",
+                        view->top + view->rows + 1, view->left + 1,
+                        view == E.view ? "\x1b[7m" : "\x1b[7;2m");
+    appendBufferAppend(ab, buffer, clen);
+    appendBufferAppend(ab, status, len);
+    while (len++ < view->cols) appendBufferAppend(ab, " ", 1);
+    appendBufferAppend(ab, "\x1b[m", 3);
+}
+
+void editorDrawView(struct append_buffer *ab, struct editorView *view) {
+    if (view->coloffset != view->drawn_coloffset) view->redraw = 1;
+    if (view->wrap) editorWrapEnsure(view);
+
+    int filerow = view->rowoffset;
+    int sub = view->wrap ? view->subrow : 0;
+    for (int y = 0; y < view->rows; y++) {
+        struct viewLine line = {-1, 0, 1};
+        if (filerow < view->buf->numrows) {
+            if (view->buf->row[filerow].flags & ROW_HL_STALE)
+                editorHighlightRow(view->buf, filerow);
+            line.row = filerow;
+            line.sub = sub;
+            line.stamp = view->buf->row[filerow].stamp;
+            if (!view->wrap || ++sub >= editorWrapRow(view, filerow)->count) {
+                filerow++;
+                sub = 0;
             }
-            appendBufferAppend(ab, "\x1b[39m", 5);
+        } else if (view->buf->numrows == 0 && y == view->rows / 3) {
+            line.row = -2;
+        }
+
+        if (!view->redraw && view->lines[y].row == line.row &&
+            view->lines[y].sub == line.sub && view->lines[y].stamp == line.stamp)
+            continue;
+        view->lines[y] = line;
+
+        char buffer[32];
+        int clen = snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH",
+                            view->top + y + 1, view->left + 1);
+        appendBufferAppend(ab, buffer, clen);
+
+        int width = editorDrawLine(ab, view, &line);
+        if (view->left + view->cols == E.screencols) {
+            appendBufferAppend(ab, "\x1b[K", 3);
+        } else {
+            while (width++ < view->cols) appendBufferAppend(ab, " ", 1);
         }
+    }
+
+    if (E.numviews > 1) editorDrawViewStatus(ab, view);
+    view->redraw = 0;
+    view->drawn_coloffset = view->coloffset;
+}
 
-        appendBufferAppend(ab, "\x1b[K", 3);
-        appendBufferAppend(ab, "\r\n", 2);
+void editorDrawSeparators(struct append_buffer *ab, struct editorLayout *node) {
+    if (node->view) return;
+    if (node->vertical) {
+        int col = node->child[1]->left;
+        for (int y = 0; y < node->rows; y++) {
+            char buffer[32];
+            int clen = snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH|",
+                                node->top + y + 1, col);
+            appendBufferAppend(ab, buffer, clen);
+        }
     }
+    editorDrawSeparators(ab, node->child[0]);
+    editorDrawSeparators(ab, node->child[1]);
 }
 
 void editorDrawStatusBar(struct append_buffer *ab) {
+    char buffer[32];
+    int clen = snprintf(buffer, sizeof(buffer), "\x1b[%d;1H", E.screenrows + 1);
+    appendBufferAppend(ab, buffer, clen);
+
     appendBufferAppend(ab, "\x1b[7m", 4);
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-      E.filename ? E.filename : "[No Name]", E.numrows,
-      E.dirty ? "[modified]" : "");
+    int len;
+    if (E.prof.overlay) {
+        len = snprintf(status, sizeof(status), "%s", E.prof.summary);
+    } else {
+        len = snprintf(status, sizeof(status), "[%d/%d] %.20s - %d lines %s",
+          editorBufferIndex(E.buf) + 1, E.numbuffers,
+          E.buf->filename ? E.buf->filename : "[No Name]", E.buf->numrows,
+          E.buf->dirty ? "[modified]" : "");
+    }
     int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-      E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+      E.buf->syntax ? E.buf->syntax->filetype : "no ft", E.view->cy + 1, E.buf->numrows);
     if (len > E.screencols) len = E.screencols;
     appendBufferAppend(ab, status, len);
     while (len < E.screencols) {
         if (E.screencols - len == rlen) {
-            puts("true");
             appendBufferAppend(ab, rstatus, rlen);
             break;
         } else {
@@ -842,25 +4174,40 @@ void editorDrawMessageBar(struct append_buffer *ab) {
 }
 
 void editorRefreshScreen() {
+    long long prof = PROF_BEGIN();
     editorScroll();
+    editorUpdateBracketMatch();
 
     struct append_buffer ab = APPEND_BUFFER_INIT;
 
     appendBufferAppend(&ab, "\x1b[?25l", 6);
-    appendBufferAppend(&ab, "\x1b[H", 3);
 
-    editorDrawRows(&ab);
+    if (E.redraw) {
+        appendBufferAppend(&ab, "\x1b[2J", 4);
+        for (int i = 0; i < E.numviews; i++) E.views[i]->redraw = 1;
+        editorDrawSeparators(&ab, E.layout);
+        E.redraw = 0;
+    }
+    for (int i = 0; i < E.numviews; i++) editorDrawView(&ab, E.views[i]);
     editorDrawStatusBar(&ab);
     editorDrawMessageBar(&ab);
 
     char buffer[32];
-    snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH", (E.cy - E.rowoffset) + 1,
-                                                                 (E.rx - E.coloffset) + 1);
+    snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH",
+             E.view->top + E.view->sy + 1, E.view->left + E.view->sx + 1);
     appendBufferAppend(&ab, buffer, strlen(buffer));
 
     appendBufferAppend(&ab, "\x1b[?25h", 6);
+    PROF_END(PROF_DRAW, prof);
 
+    prof = PROF_BEGIN();
+#ifdef TE_BENCH
+    benchOutput(ab.buf, ab.len);
+#else
     write(STDOUT_FILENO, ab.buf, ab.len);
+#endif
+    PROF_END(PROF_WRITE, prof);
+    editorProfFrame(ab.len);
     appendBufferFree(&ab);
 }
 
@@ -874,7 +4221,7 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 /*** Input ***/
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int flags) {
     size_t buffersize = 128;
     char *buffer = malloc(buffersize);
 
@@ -894,7 +4241,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
             free(buffer);
             return NULL;
         } else if (c == '\r') {
-            if (bufferlen != 0) {
+            if (bufferlen != 0 || (flags & PROMPT_ALLOW_EMPTY)) {
                 editorSetStatusMessage("");
                 if (callback) callback(buffer, c);
                 return buffer;
@@ -912,55 +4259,94 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.view->cy >= E.buf->numrows) ? NULL : &E.buf->row[E.view->cy];
 
     switch (key) {
         case ARROW_LEFT:
-            if (E.cx != 0) {
-                E.cx--;
-            } else if (E.cy > 0) {
-                E.cy--;
-                E.cx = E.row[E.cy].size;
+            if (E.view->cx != 0) {
+                E.view->cx--;
+            } else if (E.view->cy > 0) {
+                E.view->cy--;
+                E.view->cx = E.buf->row[E.view->cy].size;
             }
             break;
         case ARROW_RIGHT:
-            if (row && E.cx < row->size) {
-                E.cx++;
-            } else if (row && E.cx == row->size) {
-                E.cy++;
-                E.cx = 0;
+            if (row && E.view->cx < row->size) {
+                E.view->cx++;
+            } else if (row && E.view->cx == row->size) {
+                E.view->cy++;
+                E.view->cx = 0;
             }
             break;
         case ARROW_UP:
-            if (E.cy != 0) {
-                E.cy--;
+            if (E.view->wrap) {
+                editorWrapVertical(-1);
+            } else if (E.view->cy != 0) {
+                E.view->cy--;
             }
             break;
         case ARROW_DOWN:
-            if (E.cy < E.numrows) {
-                E.cy++;
+            if (E.view->wrap) {
+                editorWrapVertical(1);
+            } else if (E.view->cy < E.buf->numrows) {
+                E.view->cy++;
             }
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.view->cy >= E.buf->numrows) ? NULL : &E.buf->row[E.view->cy];
     int rowlen = row ? row->size : 0;
-    if (E.cx > rowlen) {
-        E.cx = rowlen;
+    if (E.view->cx > rowlen) {
+        E.view->cx = rowlen;
     }
 }
 
-void editorProcessKeypress() {
+void editorHandleKey(int c) {
     static int quit_conf = QUIT_CONFIRMATION;
 
-    int c = editorReadKey();
+    if (!E.pasting) editorUndoBeginGroup();
+    if (c != CTRL_KEY('n')) E.complete.count = 0;
 
     switch (c) {
         case '\r':
             editorInsertNewline();
             break;
+        case '\n':
+            if (E.pasting) editorInsertNewline();
+            else editorInsertChar(c);
+            break;
+        case PASTE_START:
+            E.pasting = 1;
+            editorUndoSeal();
+            break;
+        case PASTE_END:
+            E.pasting = 0;
+            editorUndoSeal();
+            break;
+        case CTRL_KEY('o'):
+            editorOpenPrompt();
+            editorUndoSeal();
+            break;
+        case CTRL_KEY('t'):
+            editorNextBuffer();
+            break;
+        case CTRL_KEY('k'):
+            if (E.buf->dirty && quit_conf > 0) {
+                editorSetStatusMessage("WARNING!!! Buffer has unsaved changes."
+                    "Press CTRL-K %d more times to close it.", quit_conf);
+                quit_conf--;
+                return;
+            }
+            editorCloseBuffer();
+            break;
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
         case CTRL_KEY('q'):
-            if (E.dirty && quit_conf > 0) {
+            if (editorAnyDirty() && quit_conf > 0) {
                 editorSetStatusMessage("WARNING!!! File has unsaved changes."
                     "Press CTRL-Q %d more times to quit.", quit_conf);
                 quit_conf--;
@@ -968,22 +4354,39 @@ void editorProcessKeypress() {
             }
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
+            while (E.numbuffers > 0) {
+                E.buf = E.view->buf = E.buffers[0];
+                editorJournalClose();
+                editorFreeBuffer();
+            }
             exit(0);
             break;
 
         case CTRL_KEY('s'):
             editorSave();
+            editorUndoSeal();
             break;
         case HOME:
-            E.cx = 0;
+            E.view->cx = 0;
+            editorUndoSeal();
             break;
         case END:
-            if (E.cy < E.numrows) {
-                E.cx = E.row[E.cy].size;
+            if (E.view->cy < E.buf->numrows) {
+                E.view->cx = E.buf->row[E.view->cy].size;
             }
+            editorUndoSeal();
             break;
         case CTRL_KEY('f'):
             editorSearch();
+            editorUndoSeal();
+            break;
+        case CTRL_KEY('r'):
+            editorReplace();
+            editorUndoSeal();
+            break;
+        case CTRL_KEY('x'):
+            editorFilter();
+            editorUndoSeal();
             break;
         case BACKSPACE:
         case CTRL_KEY('h'):
@@ -994,26 +4397,65 @@ void editorProcessKeypress() {
 
         case PAGE_UP:
         case PAGE_DOWN:
-            {
+            if (E.view->wrap) {
+                editorWrapPage(c == PAGE_UP ? -1 : 1);
+            } else {
                 if (c == PAGE_UP) {
-                    E.cy = E.rowoffset;
+                    E.view->cy = E.view->rowoffset;
                 } else if (c == PAGE_DOWN) {
-                    E.cy = E.rowoffset + E.screenrows - 1;
-                    if (E.cy > E.numrows) E.cy = E.numrows;
+                    E.view->cy = E.view->rowoffset + E.view->rows - 1;
+                    if (E.view->cy > E.buf->numrows) E.view->cy = E.buf->numrows;
                 }
-                int times = E.screenrows;
+                int times = E.view->rows;
                 while (times--)
                     editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
             }
+            editorUndoSeal();
             break;
         case ARROW_UP:
         case ARROW_DOWN:
         case ARROW_LEFT:
         case ARROW_RIGHT:
             editorMoveCursor(c);
+            editorUndoSeal();
+            break;
+
+        case CTRL_KEY('w'):
+            editorWindowCommand();
+            editorUndoSeal();
+            break;
+
+        case CTRL_KEY('n'):
+            editorComplete();
+            break;
+
+        case CTRL_KEY(']'):
+            editorMatchBracket();
+            editorUndoSeal();
+            break;
+        case CTRL_KEY('b'):
+            editorEnclosingBlock();
+            editorUndoSeal();
+            break;
+
+        case CTRL_KEY('p'):
+            editorToggleWrap();
+            editorUndoSeal();
+            break;
+
+        case CTRL_KEY('e'):
+            editorToggleFollow();
+            editorUndoSeal();
+            break;
+
+        case CTRL_KEY('g'):
+            E.prof.overlay = !E.prof.overlay;
+            editorUndoSeal();
             break;
 
         case CTRL_KEY('l'):
+            E.redraw = 1;
+            break;
         case '\x1b':
             break;
 
@@ -1024,38 +4466,313 @@ void editorProcessKeypress() {
     quit_conf = QUIT_CONFIRMATION;
 }
 
+void editorProcessKeypress() {
+    int c = editorReadKey();
+
+    long long prof = PROF_BEGIN();
+    if (prof && E.prof.frame_start == 0) E.prof.frame_start = prof;
+    E.prof.inkey = prof != 0;
+    editorHandleKey(c);
+    E.prof.inkey = 0;
+    PROF_END(PROF_KEYPRESS, prof);
+}
+
 
 /*** Init ***/
+void editorIdle() {
+    editorJournalIdle();
+    if (editorWatchPoll() + editorStreamPoll() + editorHighlightIdle())
+        editorRefreshScreen();
+}
+
 void initEditor() {
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowoffset = 0;
-    E.coloffset = 0;
-    E.numrows = 0;
-    E.row = NULL;
-    E.dirty = 0;
-    E.filename = NULL;
+    E.buffers = NULL;
+    E.numbuffers = 0;
+    E.buf = NULL;
+    E.views = NULL;
+    E.numviews = 0;
+    E.view = editorNewView(NULL);
+    E.layout = calloc(1, sizeof(struct editorLayout));
+    E.layout->view = E.view;
+    E.view->node = E.layout;
+    E.redraw = 1;
+    E.stamp = 0;
+    E.pasting = 0;
+    E.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    E.undolimit = UNDO_MAX_BYTES;
+    if (getenv("TE_UNDO_MB") && atoi(getenv("TE_UNDO_MB")) > 0)
+        E.undolimit = (size_t)atoi(getenv("TE_UNDO_MB")) * 1024 * 1024;
+    memset(&E.prof, 0, sizeof(E.prof));
+    if (getenv("TE_TRACE")) editorProfOpen(getenv("TE_TRACE"));
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
-    E.syntax = NULL;
+    editorSwitchBuffer(editorNewBuffer());
 
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     E.screenrows -= 2;
+    editorLayoutUpdate();
 }
 
+#ifndef TE_BENCH
 int main(int argc, char *argv[]) {
+    int stream = -1;
+    for (int i = 1; i < argc; i++)
+        if (!strcmp(argv[i], "-")) stream = editorStreamOpen();
+
     enableRawMode();
     initEditor();
-    if (argc >= 2) {
-        editorOpen(argv[1]);
+    signal(SIGHUP, editorJournalSignal);
+    signal(SIGTERM, editorJournalSignal);
+
+    int maxrows = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            maxrows = atoi(argv[++i]);
+            continue;
+        }
+        if (E.buf->filename || E.buf->stream != -1)
+            editorSwitchBuffer(editorNewBuffer());
+        if (!strcmp(argv[i], "-")) {
+            E.buf->stream = stream;
+            E.buf->maxrows = maxrows;
+            E.buf->follow = 1;
+        } else {
+            editorOpen(argv[i]);
+        }
     }
+    if (E.numbuffers > 1) editorSwitchBuffer(E.buffers[0]);
 
-    editorSetStatusMessage("HELP:: CTRL-S to save | CTRL-F to search | CTRL-Q to quit");
+    editorSetStatusMessage("HELP:: ^S save | ^F find | ^Z/^Y undo/redo | ^O open | ^T next | ^Q quit");
     while (1) {
-        editorRefreshScreen();
+        if (!E.pasting) editorRefreshScreen();
+        editorProcessKeypress();
+    }
+
+    return 0;
+}
+#endif
+
+/*** Benchmark ***/
+#ifdef TE_BENCH
+void benchKeyRead() {
+    bench.keys++;
+    if (bench.key_at == 0) bench.key_at = editorNowUs();
+}
+
+void benchOutput(const char *s, size_t len) {
+    bench.bytes += len;
+    if (bench.pts != -1) {
+        char drain[65536];
+        while (len > 0) {
+            ssize_t n = write(bench.pts, s, len);
+            if (n > 0) {
+                s += n;
+                len -= n;
+            }
+            while (read(bench.ptmx, drain, sizeof(drain)) > 0);
+        }
+    }
+
+    if (bench.key_at == 0) return;
+    if (bench.numframes == bench.capframes) {
+        bench.capframes = bench.capframes ? bench.capframes * 2 : 1024;
+        bench.frames = realloc(bench.frames, sizeof(long long) * bench.capframes);
+    }
+    bench.frames[bench.numframes++] = editorNowUs() - bench.key_at;
+    bench.key_at = 0;
+}
+
+int benchCompare(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+long long benchPercentile(double p) {
+    if (bench.numframes == 0) return 0;
+    size_t i = (size_t)(p * (bench.numframes - 1) + 0.5);
+    return bench.frames[i];
+}
+
+void benchFinish() {
+    long long elapsed = editorNowUs() - bench.start;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    qsort(bench.frames, bench.numframes, sizeof(long long), benchCompare);
+
+    fprintf(stderr, "%-8s %s: %d lines\n", bench.scenario, bench.filename,
+            E.buf->numrows);
+    fprintf(stderr, "  open       %lld us\n", bench.open_us);
+    fprintf(stderr, "  keys       %lld in %lld us (%.0f keys/s)\n", bench.keys,
+            elapsed, elapsed ? bench.keys * 1e6 / elapsed : 0.0);
+    fprintf(stderr, "  frames     %zu, latency us p50 %lld p90 %lld p99 %lld max %lld\n",
+            bench.numframes, benchPercentile(0.5), benchPercentile(0.9),
+            benchPercentile(0.99), benchPercentile(1.0));
+    fprintf(stderr, "  output     %lld bytes\n", bench.bytes);
+    fprintf(stderr, "  peak rss   %ld KB\n", ru.ru_maxrss);
+
+    for (int i = 0; i < E.numbuffers; i++) {
+        E.buf = E.buffers[i];
+        editorJournalClose();
+    }
+    if (bench.saveas) unlink(bench.saveas);
+    exit(0);
+}
+
+long long benchParseSize(const char *s) {
+    char *end;
+    long long n = strtoll(s, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': n <<= 10; break;
+        case 'm': case 'M': n <<= 20; break;
+        case 'g': case 'G': n <<= 30; break;
+    }
+    return n;
+}
+
+void benchGenerate(const char *filename, long long size) {
+    static const char *lines[] = {
+        "/* %d: block comment that spans",
+        "   a second line of the comment */",
+        "int fn%d(int argc, char **argv) {",
+        "\tchar *s = \"string %d with \\\"escapes\\\"\";",
+        "\tfor (int i = 0; i < %d; i++) total += i * 3.25; // loop",
+        "\tif (argc > %d) return argc;",
+        "\tdouble ratio = 0x%x / 1.5e3;",
+        "}",
+        "",
+    };
+    FILE *fp = fopen(filename, "w");
+    if (!fp) die("fopen");
+
+    unsigned int seed = 1;
+    long long written = 0;
+    for (int n = 0; written < size; n++) {
+        char line[256];
+        seed = seed * 1103515245 + 12345;
+        int len = snprintf(line, sizeof(line),
+                           lines[n % (sizeof(lines) / sizeof(lines[0]))],
+                           (seed >> 16) & 0x7fff);
+        line[len++] = '\n';
+        if (written + len > size) len = size - written;
+        fwrite(line, 1, len, fp);
+        written += len;
+    }
+    fclose(fp);
+}
+
+void benchPutKeys(FILE *fp, const char *s, int times) {
+    while (times--) fputs(s, fp);
+}
+
+FILE *benchScript(const char *scenario) {
+    static const char *text = "for (int i = 0; i < n; i++) total += i; /* typed */";
+    FILE *fp = tmpfile();
+    if (!fp) die("tmpfile");
+
+    if (!strcmp(scenario, "typing")) {
+        benchPutKeys(fp, "\x1b[6~", 4);
+        for (int i = 0; i < 400; i++) {
+            fputs(text, fp);
+            fputc('\r', fp);
+        }
+    } else if (!strcmp(scenario, "paste")) {
+        fputs("\x1b[200~", fp);
+        for (int i = 0; i < 20000; i++) {
+            fputs(text, fp);
+            fputc('\r', fp);
+        }
+        fputs("\x1b[201~", fp);
+    } else if (!strcmp(scenario, "search")) {
+        fputs("\x06return", fp);
+        benchPutKeys(fp, "\x1b[B", 500);
+        fputs("\r\x06zzznotfound\x1b", fp);
+    } else if (!strcmp(scenario, "replace")) {
+        fputs("\x12total\rsum\r\x1a\x19", fp);
+    } else if (!strcmp(scenario, "save")) {
+        benchPutKeys(fp, "x\x13", 3);
+    } else if (!strcmp(scenario, "scroll")) {
+        benchPutKeys(fp, "\x1b[6~", 2000);
+        benchPutKeys(fp, "\x1b[B", 2000);
+    } else if (strcmp(scenario, "open")) {
+        die("unknown scenario");
+    }
+
+    rewind(fp);
+    return fp;
+}
+
+void benchUsage() {
+    fprintf(stderr,
+      "usage: te_bench [-g size] [-k keyfile] [-p] [-r rows] [-c cols] scenario file\n"
+      "scenarios: open typing paste search replace save scroll replay (with -k)\n"
+      "save writes to file.save and removes it, leaving the corpus untouched\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *keyfile = NULL;
+    long long generate = 0;
+    int usepty = 0;
+    int opt;
+
+    bench.rows = BENCH_ROWS;
+    bench.cols = BENCH_COLS;
+    bench.ptmx = bench.pts = -1;
+    while ((opt = getopt(argc, argv, "g:k:pr:c:")) != -1) {
+        switch (opt) {
+            case 'g': generate = benchParseSize(optarg); break;
+            case 'k': keyfile = optarg; break;
+            case 'p': usepty = 1; break;
+            case 'r': bench.rows = atoi(optarg); break;
+            case 'c': bench.cols = atoi(optarg); break;
+            default: benchUsage();
+        }
+    }
+    if (argc - optind != 2) benchUsage();
+    bench.scenario = argv[optind];
+    bench.filename = argv[optind + 1];
+
+    if (generate) benchGenerate(bench.filename, generate);
+
+    int script;
+    if (!strcmp(bench.scenario, "replay")) {
+        if (!keyfile) benchUsage();
+        script = open(keyfile, O_RDONLY);
+        if (script == -1) die("open");
+    } else {
+        script = dup(fileno(benchScript(bench.scenario)));
+    }
+    if (dup2(script, STDIN_FILENO) == -1) die("dup2");
+    close(script);
+
+    if (usepty) {
+        bench.ptmx = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (bench.ptmx == -1 || grantpt(bench.ptmx) == -1 ||
+            unlockpt(bench.ptmx) == -1) die("posix_openpt");
+        bench.pts = open(ptsname(bench.ptmx), O_WRONLY | O_NOCTTY | O_NONBLOCK);
+        if (bench.pts == -1) die("ptsname");
+        struct winsize ws = { .ws_row = bench.rows, .ws_col = bench.cols };
+        ioctl(bench.pts, TIOCSWINSZ, &ws);
+    }
+
+    initEditor();
+    bench.start = editorNowUs();
+    editorOpen((char *)bench.filename);
+    if (!strcmp(bench.scenario, "save")) {
+        bench.saveas = malloc(strlen(bench.filename) + 6);
+        sprintf(bench.saveas, "%s.save", bench.filename);
+        free(E.buf->filename);
+        E.buf->filename = strdup(bench.saveas);
+    }
+    editorRefreshScreen();
+    bench.open_us = editorNowUs() - bench.start;
+
+    bench.start = editorNowUs();
+    while (1) {
+        if (!E.pasting) editorRefreshScreen();
         editorProcessKeypress();
     }
 
     return 0;
 }
+#endif